@@ -0,0 +1,188 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_ADAPTIVEMEASUREMENT_H
+#define GLOW_TOOLS_LOADER_ADAPTIVEMEASUREMENT_H
+
+#include "LatencyHistogram.h"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace glow {
+
+/// Decides how many timed runs a measurement needs. Runs are added until the
+/// 95% confidence interval of the median latency is narrower than a given
+/// fraction of the median, or until a time budget is spent. The interval is
+/// the distribution-free one between two order statistics of the samples,
+/// so it makes no assumption about the shape of the latency distribution.
+/// Samples farther from the median than a number of scaled median absolute
+/// deviations (MAD) are rejected as outliers before the median and its
+/// interval are computed; they still count as runs, and keptSamples() leaves
+/// them out of the samples the caller reports.
+class AdaptiveMeasurement {
+public:
+  /// Takes at least \p minRuns samples. Stops once the interval is at most
+  /// \p ciWidth times the median wide, or \p budgetNs after construction.
+  /// Samples more than \p outlierMads scaled MADs from the median are
+  /// rejected; 0 keeps all samples.
+  AdaptiveMeasurement(unsigned minRuns, double ciWidth, uint64_t budgetNs,
+                      double outlierMads)
+      : minRuns_(minRuns), ciWidth_(ciWidth), budgetNs_(budgetNs),
+        outlierMads_(outlierMads), start_(LatencyClock::now()) {}
+
+  /// Adds the time \p ns of one run.
+  void add(uint64_t ns) { samples_.push_back(ns); }
+
+  /// \returns whether another run is needed. The samples are only analyzed
+  /// every tenth of their number, so long measurements of fast models do not
+  /// spend their time sorting.
+  bool needsMoreRuns() {
+    const size_t n = samples_.size();
+    if (n < minRuns_) {
+      return true;
+    }
+    if (latencyNs(start_, LatencyClock::now()) >= budgetNs_) {
+      budgetExhausted_ = true;
+      analyze();
+      return false;
+    }
+    if (n < nextAnalysis_) {
+      return true;
+    }
+    nextAnalysis_ = n + std::max<size_t>(1, n / 10);
+    analyze();
+    return !converged();
+  }
+
+  /// \returns the samples that are not outliers, in the order they were
+  /// added.
+  std::vector<uint64_t> keptSamples() const {
+    std::vector<uint64_t> kept;
+    kept.reserve(samples_.size());
+    for (uint64_t ns : samples_) {
+      if (!isOutlier(ns)) {
+        kept.push_back(ns);
+      }
+    }
+    return kept;
+  }
+
+  size_t runs() const { return samples_.size(); }
+  size_t rejected() const { return rejected_; }
+  double median() const { return median_; }
+  double ciLow() const { return ciLow_; }
+  double ciHigh() const { return ciHigh_; }
+
+  /// \returns whether the interval reached the requested width.
+  bool converged() const {
+    return ciValid_ && median_ > 0 && (ciHigh_ - ciLow_) / median_ <= ciWidth_;
+  }
+
+  /// Prints a one line summary in milliseconds prefixed with \p label.
+  void printSummary(llvm::raw_ostream &os, llvm::StringRef label) const {
+    os << label
+       << llvm::formatv(" adaptive latency (ms): runs={0} rejected={1} "
+                        "median={2:f4}",
+                        runs(), rejected_, median_ / 1e6);
+    if (ciValid_) {
+      os << llvm::formatv(" 95% CI=[{0:f4}, {1:f4}] width={2:f2}%",
+                          ciLow_ / 1e6, ciHigh_ / 1e6,
+                          median_ ? 100 * (ciHigh_ - ciLow_) / median_ : 0.0);
+    } else {
+      os << " 95% CI=n/a";
+    }
+    os << (converged() ? ", converged\n"
+           : budgetExhausted_ ? ", time budget exhausted\n"
+                              : "\n");
+  }
+
+private:
+  /// \returns the median of the sorted \p values.
+  static double sortedMedian(const std::vector<uint64_t> &values) {
+    const size_t n = values.size();
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.0;
+  }
+
+  /// \returns whether \p ns was rejected by the last analysis.
+  bool isOutlier(uint64_t ns) const {
+    return outlierLimit_ > 0 && std::abs(double(ns) - outlierCenter_) >
+                                    outlierLimit_;
+  }
+
+  /// Rejects outliers and computes the median of the remaining samples and
+  /// its confidence interval.
+  void analyze() {
+    std::vector<uint64_t> kept(samples_);
+    std::sort(kept.begin(), kept.end());
+    outlierLimit_ = 0;
+    if (outlierMads_ > 0 && kept.size() > 2) {
+      outlierCenter_ = sortedMedian(kept);
+      std::vector<uint64_t> deviations;
+      deviations.reserve(kept.size());
+      for (uint64_t ns : kept) {
+        deviations.push_back(uint64_t(std::abs(double(ns) - outlierCenter_)));
+      }
+      std::sort(deviations.begin(), deviations.end());
+      // 1.4826 scales the MAD to the standard deviation of a normal
+      // distribution.
+      outlierLimit_ = outlierMads_ * 1.4826 * sortedMedian(deviations);
+      kept.erase(std::remove_if(kept.begin(), kept.end(),
+                                [&](uint64_t ns) { return isOutlier(ns); }),
+                 kept.end());
+    }
+    rejected_ = samples_.size() - kept.size();
+    median_ = kept.empty() ? 0.0 : sortedMedian(kept);
+    // The 1-based ranks j and k of the order statistics bounding the median
+    // with 95% confidence, from the normal approximation of the binomial
+    // distribution. Fewer than about 8 samples do not allow an interval.
+    const double n = kept.size();
+    const double spread = 1.96 * std::sqrt(n) / 2;
+    const double j = std::floor(n / 2 - spread);
+    const double k = std::ceil(n / 2 + 1 + spread);
+    ciValid_ = j >= 1 && k <= n;
+    if (ciValid_) {
+      ciLow_ = kept[size_t(j) - 1];
+      ciHigh_ = kept[size_t(k) - 1];
+    }
+  }
+
+  unsigned minRuns_;
+  double ciWidth_;
+  uint64_t budgetNs_;
+  double outlierMads_;
+  LatencyClock::time_point start_;
+  std::vector<uint64_t> samples_;
+  size_t nextAnalysis_{0};
+  size_t rejected_{0};
+  /// Median and largest accepted deviation from it of the last analysis.
+  double outlierCenter_{0};
+  double outlierLimit_{0};
+  double median_{0};
+  double ciLow_{0};
+  double ciHigh_{0};
+  bool ciValid_{false};
+  bool budgetExhausted_{false};
+};
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_ADAPTIVEMEASUREMENT_H
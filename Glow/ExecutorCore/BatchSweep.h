@@ -0,0 +1,140 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_BATCHSWEEP_H
+#define GLOW_TOOLS_LOADER_BATCHSWEEP_H
+
+#include "LatencyHistogram.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <system_error>
+
+namespace glow {
+
+/// Result of benchmarking the model compiled for one batch size.
+struct BatchSweepPoint {
+  unsigned batchSize;
+  /// Time to import and compile the model for this batch size.
+  uint64_t compileNs;
+  /// Latency of every timed run, each of which infers one whole batch.
+  LatencyHistogram latency;
+
+  double imagesPerSecond() const {
+    return latency.mean() ? batchSize * 1e9 / latency.mean() : 0.0;
+  }
+};
+
+/// \returns the index of the knee of the throughput curve of \p points,
+/// which must be sorted by batch size. Only the points up to the highest
+/// throughput are considered. With batch sizes on a log scale and both axes
+/// normalized to [0, 1] over that range, the knee is the point farthest above
+/// the line from the smallest batch size to the one of highest throughput
+/// (Kneedle). Beyond the knee, doubling the batch, and thus roughly its
+/// latency, buys comparatively little throughput.
+/// A curve that never bends above that line has its knee at the peak.
+inline size_t findThroughputKnee(llvm::ArrayRef<BatchSweepPoint> points) {
+  size_t peak = 0;
+  for (size_t i = 1; i < points.size(); i++) {
+    if (points[i].imagesPerSecond() > points[peak].imagesPerSecond()) {
+      peak = i;
+    }
+  }
+  const double x0 = std::log2(points[0].batchSize);
+  const double xRange = std::log2(points[peak].batchSize) - x0;
+  const double y0 = points[0].imagesPerSecond();
+  const double yRange = points[peak].imagesPerSecond() - y0;
+  if (peak == 0 || xRange <= 0 || yRange <= 0) {
+    return peak;
+  }
+  size_t knee = peak;
+  double kneeDistance = 0;
+  for (size_t i = 0; i < peak; i++) {
+    const double x = (std::log2(points[i].batchSize) - x0) / xRange;
+    const double y = (points[i].imagesPerSecond() - y0) / yRange;
+    if (y - x > kneeDistance) {
+      kneeDistance = y - x;
+      knee = i;
+    }
+  }
+  return knee;
+}
+
+/// Prints the throughput and latency of every point of the sweep as a table
+/// into \p os, followed by the batch size recommended by
+/// findThroughputKnee().
+inline void printBatchSweep(llvm::raw_ostream &os,
+                            llvm::ArrayRef<BatchSweepPoint> points) {
+  using LH = LatencyHistogram;
+  os << llvm::formatv("{0,6} {1,10} {2,12} {3,10} {4,10} {5,10} {6,10}\n",
+                      "batch", "compile s", "images/s", "p50 ms", "p90 ms",
+                      "p99 ms", "max ms");
+  for (const auto &point : points) {
+    const LH &latency = point.latency;
+    os << llvm::formatv(
+        "{0,6} {1,10:f3} {2,12:f2} {3,10:f4} {4,10:f4} {5,10:f4} {6,10:f4}\n",
+        point.batchSize, point.compileNs / 1e9, point.imagesPerSecond(),
+        LH::toMs(latency.percentile(50)), LH::toMs(latency.percentile(90)),
+        LH::toMs(latency.percentile(99)), LH::toMs(latency.max()));
+  }
+  if (points.empty()) {
+    return;
+  }
+  const BatchSweepPoint &knee = points[findThroughputKnee(points)];
+  double peak = 0;
+  for (const auto &point : points) {
+    peak = std::max(peak, point.imagesPerSecond());
+  }
+  os << llvm::formatv("Recommended batch size: {0} ({1:f2} images/s, "
+                      "{2:f1}% of the peak, p99 {3:f4} ms per batch)\n",
+                      knee.batchSize, knee.imagesPerSecond(),
+                      100.0 * knee.imagesPerSecond() / peak,
+                      LH::toMs(knee.latency.percentile(99)));
+}
+
+/// Writes every point of the sweep as a CSV row into \p path. \returns false
+/// if the file could not be written.
+inline bool dumpBatchSweepCSV(llvm::StringRef path,
+                              llvm::ArrayRef<BatchSweepPoint> points) {
+  std::error_code EC;
+  llvm::raw_fd_ostream os(path, EC);
+  if (EC) {
+    llvm::errs() << "Failed to open " << path << ": " << EC.message() << "\n";
+    return false;
+  }
+  const size_t knee = points.empty() ? 0 : findThroughputKnee(points);
+  os << "batch_size,compile_ns,images_per_second,mean_ns,p50_ns,p90_ns,"
+        "p99_ns,max_ns,knee\n";
+  for (size_t i = 0; i < points.size(); i++) {
+    const LatencyHistogram &latency = points[i].latency;
+    os << llvm::formatv("{0},{1},{2:f3},{3:f1},{4},{5},{6},{7},{8}\n",
+                        points[i].batchSize, points[i].compileNs,
+                        points[i].imagesPerSecond(), latency.mean(),
+                        latency.percentile(50), latency.percentile(90),
+                        latency.percentile(99), latency.max(),
+                        i == knee ? 1 : 0);
+  }
+  return true;
+}
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_BATCHSWEEP_H
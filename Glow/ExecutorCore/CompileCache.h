@@ -0,0 +1,500 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_COMPILECACHE_H
+#define GLOW_TOOLS_LOADER_COMPILECACHE_H
+
+#include "glow/Base/Tensor.h"
+#include "glow/Graph/Graph.h"
+#include "glow/Graph/PlaceholderBindings.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+namespace glow {
+
+/// Memory layout exported as <name>_config by a bundle emitted with
+/// -bundle-api=dynamic; see docs/AOT.md.
+struct BundleSymbolEntry {
+  const char *name;
+  uint64_t offset;
+  uint64_t size;
+  char kind;
+};
+struct BundleMemoryConfig {
+  uint64_t constWeightVarsMemSize;
+  uint64_t mutableWeightVarsMemSize;
+  uint64_t activationsMemSize;
+  uint64_t alignment;
+  uint64_t numSymbols;
+  const BundleSymbolEntry *symbolTable;
+};
+
+/// A Placeholder the compiled function reads or writes, as recorded in the
+/// manifest of a cache entry.
+struct CachedPlaceholder {
+  /// Key of the output in the output Placeholder map; empty for the input.
+  std::string key;
+  std::string name;
+  ElemKind kind;
+  float scale;
+  int32_t offset;
+  std::vector<dim_t> dims;
+};
+
+/// A compiled bundle loaded from the compile cache. It is shared by all
+/// workers; each one runs it through its own Instance, without involving the
+/// HostManager.
+class CachedBundle {
+public:
+  /// The Placeholders of the compiled function in one Module together with
+  /// the mutable weights and activations of one concurrent user.
+  class Instance {
+  public:
+    /// Copies the input of \p bindings in, runs inference and copies the
+    /// outputs back. \returns false if the bundle reported an error.
+    bool run(PlaceholderBindings &bindings) {
+      for (const auto &io : inputs_) {
+        const Tensor *T = bindings.get(io.first);
+        std::memcpy(mutable_.get() + io.second, T->getUnsafePtr(),
+                    T->getSizeInBytes());
+      }
+      if (bundle_.entry_(bundle_.constants_.get(), mutable_.get(),
+                         activations_.get()) != 0) {
+        return false;
+      }
+      for (const auto &io : outputs_) {
+        Tensor *T = bindings.get(io.first);
+        std::memcpy(T->getUnsafePtr(), mutable_.get() + io.second,
+                    T->getSizeInBytes());
+      }
+      return true;
+    }
+
+  private:
+    friend class CachedBundle;
+
+    explicit Instance(const CachedBundle &bundle)
+        : bundle_(bundle),
+          mutable_(bundle.allocate(bundle.config_->mutableWeightVarsMemSize)),
+          activations_(bundle.allocate(bundle.config_->activationsMemSize)) {}
+
+    const CachedBundle &bundle_;
+    std::unique_ptr<uint8_t, decltype(&std::free)> mutable_;
+    std::unique_ptr<uint8_t, decltype(&std::free)> activations_;
+    std::vector<std::pair<Placeholder *, uint64_t>> inputs_;
+    std::vector<std::pair<Placeholder *, uint64_t>> outputs_;
+  };
+
+  ~CachedBundle() {
+    if (handle_) {
+      dlclose(handle_);
+    }
+  }
+
+  /// Loads the bundle \p entryName of cache entry \p dir described by
+  /// \p placeholders. \returns nullptr and prints why if it cannot be used.
+  static std::unique_ptr<CachedBundle>
+  load(llvm::StringRef dir, llvm::StringRef entryName,
+       std::vector<CachedPlaceholder> placeholders) {
+    std::unique_ptr<CachedBundle> bundle(new CachedBundle());
+    bundle->placeholders_ = std::move(placeholders);
+    const std::string so = (dir + "/bundle.so").str();
+    bundle->handle_ = dlopen(so.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!bundle->handle_) {
+      llvm::errs() << "Compile cache: cannot load " << so << ": " << dlerror()
+                   << "\n";
+      return nullptr;
+    }
+    bundle->entry_ = reinterpret_cast<EntryFn>(
+        dlsym(bundle->handle_, entryName.str().c_str()));
+    bundle->config_ = static_cast<const BundleMemoryConfig *>(
+        dlsym(bundle->handle_, (entryName + "_config").str().c_str()));
+    if (!bundle->entry_ || !bundle->config_) {
+      llvm::errs() << "Compile cache: " << so << " does not export "
+                   << entryName << "\n";
+      return nullptr;
+    }
+
+    bundle->constants_ =
+        bundle->allocate(bundle->config_->constWeightVarsMemSize);
+    const std::string weights =
+        (dir + "/" + entryName + ".weights.bin").str();
+    std::ifstream file(weights, std::ios::binary);
+    file.read(reinterpret_cast<char *>(bundle->constants_.get()),
+              bundle->config_->constWeightVarsMemSize);
+    if (size_t(file.gcount()) != bundle->config_->constWeightVarsMemSize) {
+      llvm::errs() << "Compile cache: truncated weights in " << weights
+                   << "\n";
+      return nullptr;
+    }
+    return bundle;
+  }
+
+  /// Creates the Placeholders of the compiled function in \p mod and stores
+  /// them into \p inOut in the form returned by
+  /// buildAndCompileAndGetInAndOutPair(). \returns an Instance running the
+  /// bundle on them, or nullptr if the bundle does not match the manifest.
+  std::unique_ptr<Instance>
+  instantiate(Module &mod,
+              std::pair<Placeholder *, llvm::StringMap<Placeholder *>> &inOut)
+      const {
+    std::unique_ptr<Instance> instance(new Instance(*this));
+    for (const auto &cached : placeholders_) {
+      Placeholder *PH =
+          isQuantizedElemKind(cached.kind)
+              ? mod.createPlaceholder(cached.kind, cached.dims, cached.scale,
+                                      cached.offset, cached.name, false)
+              : mod.createPlaceholder(cached.kind, cached.dims, cached.name,
+                                      false);
+      const BundleSymbolEntry *symbol = findSymbol(cached.name);
+      if (!symbol || symbol->size < PH->getType()->getSizeInBytes()) {
+        llvm::errs() << "Compile cache: bundle has no matching symbol for "
+                     << cached.name << "\n";
+        return nullptr;
+      }
+      if (cached.key.empty()) {
+        inOut.first = PH;
+        instance->inputs_.emplace_back(PH, symbol->offset);
+      } else {
+        inOut.second[cached.key] = PH;
+        instance->outputs_.emplace_back(PH, symbol->offset);
+      }
+    }
+    return instance;
+  }
+
+private:
+  using EntryFn = int (*)(uint8_t *constantWeight, uint8_t *mutableWeight,
+                          uint8_t *activations);
+
+  CachedBundle() = default;
+
+  std::unique_ptr<uint8_t, decltype(&std::free)> allocate(size_t size) const {
+    const size_t align = std::max<uint64_t>(config_->alignment, 64);
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, align, std::max<size_t>(size, 1)) != 0) {
+      ptr = nullptr;
+    }
+    return {static_cast<uint8_t *>(ptr), &std::free};
+  }
+
+  const BundleSymbolEntry *findSymbol(llvm::StringRef name) const {
+    for (uint64_t i = 0; i < config_->numSymbols; i++) {
+      if (name == config_->symbolTable[i].name) {
+        return &config_->symbolTable[i];
+      }
+    }
+    return nullptr;
+  }
+
+  void *handle_{nullptr};
+  EntryFn entry_{nullptr};
+  const BundleMemoryConfig *config_{nullptr};
+  std::unique_ptr<uint8_t, decltype(&std::free)> constants_{nullptr,
+                                                            &std::free};
+  std::vector<CachedPlaceholder> placeholders_;
+};
+
+/// On-disk cache of compiled functions. Each entry is a directory holding
+/// the bundle Glow emits for the function, linked into a shared object, its
+/// constant weights and a manifest of the Placeholders it reads and writes.
+/// Entries are keyed by the contents of the model files, the compile
+/// relevant command line options (backend, precision, ...) and the type of
+/// the input the function is compiled for. Entries are produced by rerunning
+/// the executable in -emit-bundle mode once the cold run has finished, so the
+/// extra compilation never overlaps measurements.
+class CompileCache {
+public:
+  /// Name of the network and entry point of cached bundles.
+  static const char *entryName() { return "glow_cached"; }
+
+  /// Creates a cache rooted at \p dir. \p keyArgs are the command line
+  /// options that influence compilation, \p modelPaths the files or
+  /// directories holding the model, \p rerunArgs the command line used to
+  /// emit a bundle of the same function, starting with the executable, and
+  /// \p compiler the C compiler that links emitted bundles.
+  CompileCache(llvm::StringRef dir, llvm::ArrayRef<std::string> keyArgs,
+               llvm::ArrayRef<std::string> modelPaths,
+               std::vector<std::string> rerunArgs, llvm::StringRef compiler)
+      : dir_(dir.str()), rerunArgs_(std::move(rerunArgs)),
+        compiler_(compiler.str()) {
+    if (std::error_code EC = llvm::sys::fs::create_directories(dir_)) {
+      llvm::errs() << "Compile cache disabled, cannot create " << dir_ << ": "
+                   << EC.message() << "\n";
+      dir_.clear();
+      return;
+    }
+    baseKey_ = 0xcbf29ce484222325ULL;
+    for (const auto &arg : keyArgs) {
+      hashBytes(baseKey_, arg.data(), arg.size() + 1);
+    }
+    for (const auto &path : modelPaths) {
+      if (!hashPath(baseKey_, path)) {
+        llvm::errs() << "Compile cache disabled, cannot read model " << path
+                     << "\n";
+        dir_.clear();
+        return;
+      }
+    }
+  }
+
+  CompileCache(const CompileCache &) = delete;
+  CompileCache &operator=(const CompileCache &) = delete;
+
+  /// \returns whether the cache is usable.
+  bool enabled() const { return !dir_.empty(); }
+
+  /// \returns whether lookup() found a usable entry.
+  bool hit() const { return bundle_ != nullptr; }
+
+  /// \returns the cached bundle of the function compiled for \p inputType,
+  /// or nullptr on a miss. Thread safe; the entry is loaded only once.
+  CachedBundle *lookup(const Type &inputType) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!looked_) {
+      looked_ = true;
+      key_ = computeKey(inputType);
+      std::vector<CachedPlaceholder> placeholders;
+      if (readManifest(entryDir() + "/manifest", placeholders)) {
+        bundle_ = CachedBundle::load(entryDir(), entryName(),
+                                     std::move(placeholders));
+      }
+    }
+    return bundle_.get();
+  }
+
+  /// Records the Placeholders \p input and \p outputs of the function
+  /// compiled on a miss, for the manifest of the new entry.
+  void recordPlaceholders(Placeholder *input,
+                          const llvm::StringMap<Placeholder *> &outputs) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!recorded_.empty()) {
+      return;
+    }
+    recorded_.push_back(describe("", input));
+    for (const auto &output : outputs) {
+      recorded_.push_back(describe(output.getKey(), output.getValue()));
+    }
+  }
+
+  /// After a miss, emits and links the bundle of the recorded function and
+  /// publishes it as a new entry. \returns whether an entry was stored.
+  bool store() {
+    if (!enabled() || bundle_ || recorded_.empty()) {
+      return false;
+    }
+    const std::string tmpDir =
+        llvm::formatv("{0}.tmp.{1}", entryDir(), getpid()).str();
+    llvm::sys::fs::remove_directories(tmpDir);
+    if (llvm::sys::fs::create_directories(tmpDir)) {
+      return false;
+    }
+    bool ok = emitBundle(tmpDir) && linkBundle(tmpDir) &&
+              writeManifest(tmpDir + "/manifest");
+    if (ok && llvm::sys::fs::rename(tmpDir, entryDir())) {
+      // Another process published the same entry first.
+      ok = llvm::sys::fs::is_directory(entryDir());
+    }
+    llvm::sys::fs::remove_directories(tmpDir);
+    return ok;
+  }
+
+  std::string entryDir() const {
+    return llvm::formatv("{0}/{1:x-16}", dir_, key_);
+  }
+
+private:
+  /// 64-bit FNV-1a, stable across processes and builds.
+  static void hashBytes(uint64_t &h, const void *bytes, size_t len) {
+    const unsigned char *p = static_cast<const unsigned char *>(bytes);
+    for (size_t i = 0; i < len; i++) {
+      h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+  }
+
+  /// Hashes the contents of \p path, or of every file in it if it is a
+  /// directory.
+  static bool hashPath(uint64_t &h, const std::string &path) {
+    if (llvm::sys::fs::is_directory(path)) {
+      std::vector<std::string> files;
+      std::error_code EC;
+      for (llvm::sys::fs::recursive_directory_iterator it(path, EC), end;
+           !EC && it != end; it.increment(EC)) {
+        if (llvm::sys::fs::is_regular_file(it->path())) {
+          files.push_back(it->path());
+        }
+      }
+      std::sort(files.begin(), files.end());
+      for (const auto &file : files) {
+        hashBytes(h, file.data(), file.size() + 1);
+        if (!hashPath(h, file)) {
+          return false;
+        }
+      }
+      return !EC;
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      return false;
+    }
+    std::vector<char> chunk(1 << 20);
+    while (file.read(chunk.data(), chunk.size()) || file.gcount()) {
+      hashBytes(h, chunk.data(), file.gcount());
+    }
+    return true;
+  }
+
+  uint64_t computeKey(const Type &inputType) const {
+    uint64_t h = baseKey_;
+    const uint32_t kind = static_cast<uint32_t>(inputType.getElementType());
+    hashBytes(h, &kind, sizeof(kind));
+    for (dim_t d : inputType.dims()) {
+      const uint64_t dim = d;
+      hashBytes(h, &dim, sizeof(dim));
+    }
+    return h;
+  }
+
+  static CachedPlaceholder describe(llvm::StringRef key, Placeholder *PH) {
+    const Type &ty = *PH->getType();
+    CachedPlaceholder cached;
+    cached.key = key.str();
+    cached.name = PH->getName().str();
+    cached.kind = ty.getElementType();
+    cached.scale = ty.isQuantizedType() ? ty.getScale() : 0.0f;
+    cached.offset = ty.isQuantizedType() ? ty.getOffset() : 0;
+    cached.dims.assign(ty.dims().begin(), ty.dims().end());
+    return cached;
+  }
+
+  /// The manifest holds one Placeholder per line as tab separated fields:
+  /// key, name, element kind, scale, offset and the dimensions.
+  bool writeManifest(const std::string &path) const {
+    std::error_code EC;
+    llvm::raw_fd_ostream os(path, EC);
+    if (EC) {
+      return false;
+    }
+    for (const auto &cached : recorded_) {
+      os << cached.key << "\t" << cached.name << "\t"
+         << static_cast<unsigned>(cached.kind) << "\t"
+         << llvm::formatv("{0:e9}", cached.scale) << "\t" << cached.offset;
+      for (dim_t d : cached.dims) {
+        os << "\t" << d;
+      }
+      os << "\n";
+    }
+    return true;
+  }
+
+  static bool readManifest(const std::string &path,
+                           std::vector<CachedPlaceholder> &placeholders) {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      llvm::SmallVector<llvm::StringRef, 10> fields;
+      llvm::StringRef(line).split(fields, '\t');
+      unsigned kind;
+      double scale;
+      CachedPlaceholder cached;
+      if (fields.size() < 6 || fields[2].getAsInteger(10, kind) ||
+          fields[3].getAsDouble(scale) ||
+          fields[4].getAsInteger(10, cached.offset)) {
+        return false;
+      }
+      cached.key = fields[0].str();
+      cached.name = fields[1].str();
+      cached.kind = static_cast<ElemKind>(kind);
+      cached.scale = scale;
+      for (size_t i = 5; i < fields.size(); i++) {
+        uint64_t d;
+        if (fields[i].getAsInteger(10, d)) {
+          return false;
+        }
+        cached.dims.push_back(d);
+      }
+      placeholders.push_back(std::move(cached));
+    }
+    return !placeholders.empty();
+  }
+
+  /// Reruns the executable to emit a bundle of the function into \p dir.
+  bool emitBundle(const std::string &dir) const {
+    std::vector<std::string> args = rerunArgs_;
+    args.push_back("-emit-bundle=" + dir);
+    args.push_back("-bundle-api=dynamic");
+    args.push_back("-relocation-model=pic");
+    args.push_back(std::string("-network-name=") + entryName());
+    return execute(args[0], args);
+  }
+
+  /// Links the emitted object into a shared object that can be dlopen'ed.
+  bool linkBundle(const std::string &dir) const {
+    return execute(compiler_, {compiler_, "-shared", "-o", dir + "/bundle.so",
+                               dir + "/" + entryName() + ".o", "-lm"});
+  }
+
+  static bool execute(const std::string &program,
+                      llvm::ArrayRef<std::string> args) {
+    std::vector<llvm::StringRef> argRefs(args.begin(), args.end());
+    llvm::Optional<llvm::StringRef> redirects[] = {llvm::StringRef(""),
+                                                   llvm::StringRef(""),
+                                                   llvm::None};
+    std::string errMsg;
+    const int rc = llvm::sys::ExecuteAndWait(program, argRefs, llvm::None,
+                                             redirects, 0, 0, &errMsg);
+    if (rc != 0) {
+      llvm::errs() << "Compile cache: " << program << " failed ("
+                   << (errMsg.empty() ? std::to_string(rc) : errMsg) << ")\n";
+    }
+    return rc == 0;
+  }
+
+  std::string dir_;
+  std::vector<std::string> rerunArgs_;
+  std::string compiler_;
+  uint64_t baseKey_{0};
+  uint64_t key_{0};
+  std::mutex mu_;
+  bool looked_{false};
+  std::unique_ptr<CachedBundle> bundle_;
+  std::vector<CachedPlaceholder> recorded_;
+};
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_COMPILECACHE_H
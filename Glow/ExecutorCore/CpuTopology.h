@@ -0,0 +1,296 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_CPUTOPOLOGY_H
+#define GLOW_TOOLS_LOADER_CPUTOPOLOGY_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace glow {
+
+/// How worker threads are placed onto CPUs.
+enum class CpuPlacement {
+  /// Workers are not pinned.
+  None,
+  /// Fill one NUMA node before the next, hyperthread siblings adjacent.
+  Compact,
+  /// Round-robin over NUMA nodes, physical cores before their siblings.
+  Scatter,
+  /// One worker per physical core, never sharing a core while one is free.
+  PhysicalCore,
+  /// Worker i runs on the i-th CPU of an explicit list.
+  List,
+};
+
+/// Parses a CPU list such as "0-3,8,10-11" into \p cpus. \returns false if
+/// \p list is malformed.
+inline bool parseCpuList(llvm::StringRef list, std::vector<unsigned> &cpus) {
+  llvm::SmallVector<llvm::StringRef, 8> ranges;
+  list.trim().split(ranges, ',', -1, false);
+  for (llvm::StringRef range : ranges) {
+    llvm::StringRef first, last;
+    std::tie(first, last) = range.trim().split('-');
+    unsigned lo, hi;
+    if (first.getAsInteger(10, lo)) {
+      return false;
+    }
+    hi = lo;
+    if (!last.empty() && last.getAsInteger(10, hi)) {
+      return false;
+    }
+    if (hi < lo) {
+      return false;
+    }
+    for (unsigned cpu = lo; cpu <= hi; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return !cpus.empty();
+}
+
+/// The CPUs this process may run on, with the NUMA node, package and
+/// physical core of each, as reported by sysfs.
+class CpuTopology {
+public:
+  struct Cpu {
+    unsigned id;
+    unsigned node;
+    unsigned package;
+    unsigned core;
+    /// Index of this CPU among the hyperthreads of its physical core.
+    unsigned thread;
+  };
+
+  /// Reads the topology of the CPUs in the affinity mask of the calling
+  /// thread. Missing sysfs entries are treated as node, package or core 0.
+  static CpuTopology detect() {
+    CpuTopology topo;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+      return topo;
+    }
+    std::map<unsigned, unsigned> nodeOf;
+    std::error_code EC;
+    for (llvm::sys::fs::directory_iterator it("/sys/devices/system/node", EC),
+         end;
+         !EC && it != end; it.increment(EC)) {
+      llvm::StringRef name = llvm::sys::path::filename(it->path());
+      unsigned node;
+      std::vector<unsigned> cpus;
+      if (name.consume_front("node") && !name.getAsInteger(10, node) &&
+          parseCpuList(readLine(it->path() + "/cpulist"), cpus)) {
+        for (unsigned cpu : cpus) {
+          nodeOf[cpu] = node;
+        }
+      }
+    }
+    for (unsigned id = 0; id < CPU_SETSIZE; id++) {
+      if (!CPU_ISSET(id, &allowed)) {
+        continue;
+      }
+      const std::string dir =
+          "/sys/devices/system/cpu/cpu" + std::to_string(id) + "/topology/";
+      Cpu cpu = {id, nodeOf.count(id) ? nodeOf[id] : 0,
+                 readUnsigned(dir + "physical_package_id"),
+                 readUnsigned(dir + "core_id"), 0};
+      topo.cpus_.push_back(cpu);
+    }
+    // Number the hyperthreads of every physical core in CPU id order.
+    std::map<std::pair<unsigned, unsigned>, unsigned> threadsSeen;
+    for (auto &cpu : topo.cpus_) {
+      cpu.thread = threadsSeen[{cpu.package, cpu.core}]++;
+    }
+    return topo;
+  }
+
+  llvm::ArrayRef<Cpu> cpus() const { return cpus_; }
+
+  size_t numNodes() const {
+    std::set<unsigned> nodes;
+    for (const auto &cpu : cpus_) {
+      nodes.insert(cpu.node);
+    }
+    return nodes.size();
+  }
+
+  size_t numCores() const {
+    return std::count_if(cpus_.begin(), cpus_.end(),
+                         [](const Cpu &cpu) { return cpu.thread == 0; });
+  }
+
+  /// \returns the NUMA node of CPU \p id, or 0 if it is not in the topology.
+  unsigned nodeOf(unsigned id) const {
+    for (const auto &cpu : cpus_) {
+      if (cpu.id == id) {
+        return cpu.node;
+      }
+    }
+    return 0;
+  }
+
+  /// \returns the CPU of each of \p numWorkers workers under \p policy. For
+  /// CpuPlacement::List the CPUs are taken from \p list. Workers wrap around
+  /// when there are fewer CPUs than workers. \returns an empty vector for
+  /// CpuPlacement::None.
+  std::vector<unsigned> place(CpuPlacement policy, size_t numWorkers,
+                              llvm::ArrayRef<unsigned> list = {}) const {
+    std::vector<Cpu> order(cpus_.begin(), cpus_.end());
+    auto byLocality = [](const Cpu &a, const Cpu &b) {
+      return std::tie(a.node, a.package, a.core, a.thread, a.id) <
+             std::tie(b.node, b.package, b.core, b.thread, b.id);
+    };
+    std::vector<unsigned> ids;
+    switch (policy) {
+    case CpuPlacement::None:
+      return {};
+    case CpuPlacement::List:
+      ids.assign(list.begin(), list.end());
+      break;
+    case CpuPlacement::Compact:
+      std::sort(order.begin(), order.end(), byLocality);
+      break;
+    case CpuPlacement::PhysicalCore:
+      std::sort(order.begin(), order.end(), byLocality);
+      order.erase(std::remove_if(order.begin(), order.end(),
+                                 [](const Cpu &cpu) { return cpu.thread; }),
+                  order.end());
+      break;
+    case CpuPlacement::Scatter: {
+      // Within each node, first threads of all cores come before siblings;
+      // the nodes are then interleaved.
+      std::map<unsigned, std::vector<Cpu>> perNode;
+      for (const auto &cpu : cpus_) {
+        perNode[cpu.node].push_back(cpu);
+      }
+      order.clear();
+      size_t longest = 0;
+      for (auto &node : perNode) {
+        std::sort(node.second.begin(), node.second.end(),
+                  [](const Cpu &a, const Cpu &b) {
+                    return std::tie(a.thread, a.package, a.core, a.id) <
+                           std::tie(b.thread, b.package, b.core, b.id);
+                  });
+        longest = std::max(longest, node.second.size());
+      }
+      for (size_t i = 0; i < longest; i++) {
+        for (auto &node : perNode) {
+          if (i < node.second.size()) {
+            order.push_back(node.second[i]);
+          }
+        }
+      }
+      break;
+    }
+    }
+    if (policy != CpuPlacement::List) {
+      for (const auto &cpu : order) {
+        ids.push_back(cpu.id);
+      }
+    }
+    std::vector<unsigned> placement;
+    for (size_t i = 0; i < numWorkers && !ids.empty(); i++) {
+      placement.push_back(ids[i % ids.size()]);
+    }
+    return placement;
+  }
+
+  /// Prints a one line summary of the topology into \p os.
+  void print(llvm::raw_ostream &os) const {
+    os << "CPU topology: " << numNodes() << " NUMA node(s), " << numCores()
+       << " physical core(s), " << cpus_.size() << " CPU(s) available\n";
+  }
+
+private:
+  static std::string readLine(const std::string &path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+  }
+
+  static unsigned readUnsigned(const std::string &path) {
+    unsigned value = 0;
+    llvm::StringRef(readLine(path)).trim().getAsInteger(10, value);
+    return value;
+  }
+
+  std::vector<Cpu> cpus_;
+};
+
+/// Restricts the calling thread to CPU \p cpu. \returns false on failure.
+inline bool pinCurrentThread(unsigned cpu) {
+  if (cpu >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/// Restricts the calling thread to the union of \p cpus until destroyed, then
+/// restores its previous affinity. Threads it creates meanwhile, such as the
+/// device and executor threads of a HostManager, keep the restriction.
+class ScopedThreadAffinity {
+public:
+  explicit ScopedThreadAffinity(llvm::ArrayRef<unsigned> cpus) {
+    if (cpus.empty() ||
+        pthread_getaffinity_np(pthread_self(), sizeof(saved_), &saved_) != 0) {
+      return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned cpu : cpus) {
+      if (cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    active_ = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+  }
+
+  ~ScopedThreadAffinity() {
+    if (active_) {
+      pthread_setaffinity_np(pthread_self(), sizeof(saved_), &saved_);
+    }
+  }
+
+  ScopedThreadAffinity(const ScopedThreadAffinity &) = delete;
+  ScopedThreadAffinity &operator=(const ScopedThreadAffinity &) = delete;
+
+private:
+  cpu_set_t saved_;
+  bool active_{false};
+};
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_CPUTOPOLOGY_H
@@ -16,8 +16,22 @@
 
 #include "ExecutorCore.h"
 
+#include "AdaptiveMeasurement.h"
+#include "BatchSweep.h"
+#include "CompileCache.h"
+#include "CpuTopology.h"
 #include "ExecutorCoreHelperFunctions.h"
+#include "Float16Conversion.h"
+#include "ImagePreprocess.h"
+#include "InputTensorCache.h"
+#include "LatencyHistogram.h"
 #include "Loader.h"
+#include "OperatorProfile.h"
+#include "PerfCounters.h"
+#include "PlaceholderArena.h"
+#include "ThreadSweep.h"
+#include "TraceEventRing.h"
+#include "TraceWriter.h"
 
 #include "glow/Base/Image.h"
 #include "glow/Base/TensorSerialization.h"
@@ -26,32 +40,2424 @@
 #include "glow/Importer/ONNXModelLoader.h"
 #include "glow/Optimizer/IROptimizer/CommandLine.h"
 
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringSwitch.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
 #include <atomic>
 #include <cfloat>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <numeric>
 #include <queue>
+#include <random>
 #include <sstream>
 #include <thread>
+#include <tuple>
 
-#include <chrono>
-#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 extern llvm::cl::opt<unsigned> traceLevel;
+extern llvm::cl::opt<unsigned> poolSize;
+extern std::vector<std::string> modelPathOpt;
+extern llvm::cl::opt<std::string> dumpProfileFileOpt;
+extern llvm::cl::opt<std::string> loadProfileFileOpt;
 
 using namespace glow;
 
 namespace {
 
+llvm::cl::OptionCategory latencyCat("Latency Measurement Options");
+
+llvm::cl::opt<unsigned> latencyWarmupRuns(
+    "latency-warmup",
+    llvm::cl::desc("Number of untimed inference runs executed for each "
+                   "minibatch before latency is measured."),
+    llvm::cl::Optional, llvm::cl::init(5), llvm::cl::cat(latencyCat));
+
+llvm::cl::opt<unsigned> latencyMeasuredRuns(
+    "latency-runs",
+    llvm::cl::desc("Number of timed inference runs executed for each "
+                   "minibatch. Every run is recorded in the latency "
+                   "histogram."),
+    llvm::cl::Optional, llvm::cl::init(10), llvm::cl::cat(latencyCat));
+
+llvm::cl::opt<bool> latencyAdaptive(
+    "latency-adaptive",
+    llvm::cl::desc("Instead of a fixed -latency-runs, time runs until the 95% "
+                   "confidence interval of the median latency is narrower "
+                   "than -latency-ci-width or -latency-time-budget-ms is "
+                   "spent. -latency-runs becomes the minimum number of runs."),
+    llvm::cl::Optional, llvm::cl::init(false), llvm::cl::cat(latencyCat));
+
+llvm::cl::opt<double> latencyCIWidth(
+    "latency-ci-width",
+    llvm::cl::desc("Width of the 95% confidence interval of the median, "
+                   "relative to the median, at which -latency-adaptive "
+                   "stops."),
+    llvm::cl::Optional, llvm::cl::init(0.02), llvm::cl::cat(latencyCat));
+
+llvm::cl::opt<unsigned> latencyTimeBudgetMs(
+    "latency-time-budget-ms",
+    llvm::cl::desc("Maximum time -latency-adaptive spends on timed runs per "
+                   "worker, shared evenly by the minibatches of the worker, "
+                   "or per batch size of -batch-sweep and per model."),
+    llvm::cl::Optional, llvm::cl::init(10000), llvm::cl::cat(latencyCat));
+
+llvm::cl::opt<double> latencyOutlierMads(
+    "latency-outlier-mads",
+    llvm::cl::desc("With -latency-adaptive, runs farther from the median than "
+                   "this many scaled median absolute deviations are rejected "
+                   "as outliers before the median and its confidence interval "
+                   "are computed. 0 keeps all runs."),
+    llvm::cl::Optional, llvm::cl::init(3.0), llvm::cl::cat(latencyCat));
+
+llvm::cl::opt<bool> perfCountersOpt(
+    "perf-counters",
+    llvm::cl::desc("Read hardware performance counters (cycles, instructions, "
+                   "stalled cycles, LLC, branch and dTLB misses) of every "
+                   "worker's thread and the threads its Loader created before "
+                   "and after every timed inference of a minibatch, and print "
+                   "their per-inference averages, IPC and LLC misses per "
+                   "thousand instructions for every worker. Skipped with a "
+                   "warning if the counters cannot be opened."),
+    llvm::cl::Optional, llvm::cl::init(false), llvm::cl::cat(latencyCat));
+
+/// Times \p run into \p latency, and into \p runTimesNs if given: either
+/// -latency-runs times, or with -latency-adaptive until the median latency
+/// converges. Runs rejected as outliers are left out of \p latency and
+/// \p runTimesNs and only counted in the summary. The caller makes
+/// \p numMeasurements such measurements, which share
+/// -latency-time-budget-ms. With \p counters, the hardware counters are read
+/// around every run, outside of its timed interval, and accumulated into
+/// \p counterTotals. \p sharedCounters, if given, count the whole
+/// measurement. \returns the summary of the adaptive measurement prefixed
+/// with \p label, or an empty string without -latency-adaptive.
+std::string timeRuns(const std::function<void()> &run,
+                     LatencyHistogram &latency, llvm::StringRef label,
+                     size_t numMeasurements,
+                     std::vector<uint64_t> *runTimesNs = nullptr,
+                     PerfCounters *counters = nullptr,
+                     PerfCounterTotals *counterTotals = nullptr,
+                     SharedPerfCounters *sharedCounters = nullptr) {
+  uint64_t numRuns = 0;
+  if (sharedCounters) {
+    sharedCounters->begin();
+  }
+  auto timeRun = [&]() {
+    const PerfCounts countsStart = counters ? counters->read() : PerfCounts();
+    const auto runStart = LatencyClock::now();
+    run();
+    const uint64_t ns = latencyNs(runStart, LatencyClock::now());
+    if (counters) {
+      counterTotals->add(countsStart, counters->read());
+    }
+    numRuns++;
+    return ns;
+  };
+  auto recordRun = [&](uint64_t ns) {
+    latency.record(ns);
+    if (runTimesNs) {
+      runTimesNs->push_back(ns);
+    }
+  };
+  if (!latencyAdaptive) {
+    for (unsigned i = 0; i < latencyMeasuredRuns; i++) {
+      recordRun(timeRun());
+    }
+    if (sharedCounters) {
+      sharedCounters->end(numRuns);
+    }
+    return "";
+  }
+  AdaptiveMeasurement measurement(
+      latencyMeasuredRuns, latencyCIWidth,
+      uint64_t(latencyTimeBudgetMs) * 1000000 /
+          std::max<size_t>(numMeasurements, 1),
+      latencyOutlierMads);
+  while (measurement.needsMoreRuns()) {
+    measurement.add(timeRun());
+  }
+  if (sharedCounters) {
+    sharedCounters->end(numRuns);
+  }
+  for (uint64_t ns : measurement.keptSamples()) {
+    recordRun(ns);
+  }
+  std::string summary;
+  llvm::raw_string_ostream os(summary);
+  measurement.printSummary(os, label);
+  return os.str();
+}
+
+llvm::cl::opt<bool> latencyPrintEachRun(
+    "latency-print-each-run",
+    llvm::cl::desc("Print the time of every timed run and the per-minibatch "
+                   "average, as parsed by utils/gather_data.py."),
+    llvm::cl::Optional, llvm::cl::init(true), llvm::cl::cat(latencyCat));
+
+llvm::cl::opt<std::string> latencyJSONPath(
+    "latency-json",
+    llvm::cl::desc("Write the latency histogram summary of all timed runs "
+                   "as JSON to this file."),
+    llvm::cl::value_desc("file.json"), llvm::cl::Optional,
+    llvm::cl::cat(latencyCat));
+
+llvm::cl::opt<std::string> startupJSONPath(
+    "startup-json",
+    llvm::cl::desc("Write the wall time of every startup phase, from command "
+                   "line parsing to the end of the first inference, as JSON "
+                   "to this file."),
+    llvm::cl::value_desc("file.json"), llvm::cl::Optional,
+    llvm::cl::cat(latencyCat));
+
+/// Wall times of the phases between process start and the first inference.
+/// Phases that several workers go through are reported for the first worker
+/// to complete them.
+class StartupPhases {
+public:
+  enum Phase {
+    CommandLineParsing,
+    InputPreload,
+    /// Model import, graph optimization, backend compilation and constant
+    /// upload, which Glow performs within one call of
+    /// buildAndCompileAndGetInAndOutPair().
+    ModelBuild,
+    /// ModelBuild up to the end of the loader extensions' postModelLoad().
+    ModelImport,
+    /// The rest of ModelBuild: the HostManager's addNetwork().
+    OptimizeCompileUpload,
+    /// The parts of OptimizeCompileUpload. addNetwork() offers no hook
+    /// between them, so they are reported as not observed.
+    GraphOptimization,
+    BackendCompile,
+    ConstantUpload,
+    CompileCacheLoad,
+    FirstInference,
+    TimeToFirstInference,
+    NumPhases
+  };
+
+  /// Marks the start of the process, as far as the executor can observe it.
+  void start() { start_ = LatencyClock::now(); }
+
+  /// Records \p ns as the duration of \p phase unless it was recorded
+  /// already.
+  void record(Phase phase, uint64_t ns) {
+    uint64_t unset = 0;
+    phases_[phase].compare_exchange_strong(unset, std::max<uint64_t>(ns, 1));
+  }
+
+  /// Records \p ns as the duration of the first inference, which just ended.
+  void recordFirstInference(uint64_t ns) {
+    recordFirstInference(ns, LatencyClock::now());
+  }
+
+  /// Records \p ns as the duration of the first inference, which ended at
+  /// \p end.
+  void recordFirstInference(uint64_t ns, LatencyClock::time_point end) {
+    record(FirstInference, ns);
+    record(TimeToFirstInference, latencyNs(start_, end));
+  }
+
+  /// Writes the recorded phases in ms, and the \p engine that ran the
+  /// inferences, as a JSON object to \p path. Every phase is written, as
+  /// null if it was not observed. \returns false if the file could not be
+  /// written.
+  bool dumpJSON(llvm::StringRef path, llvm::StringRef engine) const {
+    static const char *const keys[NumPhases] = {
+        "command_line_parsing_ms", "input_preload_ms",
+        "import_optimize_compile_upload_ms", "import_ms",
+        "optimize_compile_upload_ms", "graph_optimization_ms",
+        "backend_compile_ms", "constant_upload_ms", "compile_cache_load_ms",
+        "first_inference_ms", "time_to_first_inference_ms"};
+    std::error_code EC;
+    llvm::raw_fd_ostream os(path, EC);
+    if (EC) {
+      llvm::errs() << "Failed to open " << path << ": " << EC.message()
+                   << "\n";
+      return false;
+    }
+    os << "{\n  \"model\": \"";
+    TraceWriter::writeEscaped(os, Loader::getModelOptPath());
+    os << "\",\n  \"engine\": \"";
+    TraceWriter::writeEscaped(os, engine);
+    os << "\"";
+    for (unsigned i = 0; i < NumPhases; i++) {
+      os << ",\n  \"" << keys[i] << "\": ";
+      if (uint64_t ns = phases_[i].load()) {
+        os << llvm::formatv("{0:f3}", LatencyHistogram::toMs(ns));
+      } else {
+        os << "null";
+      }
+    }
+    os << "\n}\n";
+    return true;
+  }
+
+private:
+  LatencyClock::time_point start_{LatencyClock::now()};
+  std::atomic<uint64_t> phases_[NumPhases] = {};
+};
+
+StartupPhases startupPhases;
+
+/// Stamps the end of model import. buildAndCompileAndGetInAndOutPair() calls
+/// postModelLoad() of the Loader's extensions once the ONNX or Caffe2
+/// importer returned, right before it compiles the module.
+class ImportEndStamp : public LoaderExtension {
+public:
+  void postModelLoad(Loader &, PlaceholderBindings &, ProtobufLoader &,
+                     llvm::StringMap<Placeholder *> &, size_t) override {
+    end_ = LatencyClock::now();
+    stamped_ = true;
+  }
+  void inferInitMiniBatch(Loader &, PlaceholderBindings &, size_t,
+                          size_t) override {}
+  void inferEndMiniBatch(Loader &, PlaceholderBindings &, size_t,
+                         size_t) override {}
+
+  /// \returns whether import ended, and when in \p end.
+  bool getEnd(LatencyClock::time_point &end) const {
+    end = end_;
+    return stamped_;
+  }
+
+private:
+  LatencyClock::time_point end_;
+  bool stamped_{false};
+};
+
+/// Like buildAndCompileAndGetInAndOutPair(), and with -startup-json also
+/// splits the build of \p loader into import and the rest. The stamp is
+/// registered after the other extensions, so their post-load graph changes
+/// count as import.
+std::pair<Placeholder *, llvm::StringMap<Placeholder *>>
+buildAndRecordStartupPhases(Loader &loader, PlaceholderBindings &bindings,
+                            const Type &type) {
+  if (startupJSONPath.empty()) {
+    return buildAndCompileAndGetInAndOutPair(loader, bindings, type);
+  }
+  auto stamp = glow::make_unique<ImportEndStamp>();
+  const ImportEndStamp *importEnd = stamp.get();
+  loader.registerExtension(std::move(stamp));
+  const auto buildStart = LatencyClock::now();
+  auto inputOutputPair =
+      buildAndCompileAndGetInAndOutPair(loader, bindings, type);
+  const auto buildEnd = LatencyClock::now();
+  LatencyClock::time_point importEndTime;
+  if (importEnd->getEnd(importEndTime)) {
+    startupPhases.record(StartupPhases::ModelImport,
+                         latencyNs(buildStart, importEndTime));
+    startupPhases.record(StartupPhases::OptimizeCompileUpload,
+                         latencyNs(importEndTime, buildEnd));
+  }
+  return inputOutputPair;
+}
+
+llvm::cl::opt<bool> contextPoolArena(
+    "context-pool-arena",
+    llvm::cl::desc("Back the placeholders of the -iterations benchmark "
+                   "context pool with one pre-faulted arena instead of "
+                   "separate heap tensors, so even the first runs take no "
+                   "page faults or allocator work."),
+    llvm::cl::Optional, llvm::cl::init(true), llvm::cl::cat(latencyCat));
+
+/// Like setupContextPool(), but the input and output tensors of every
+/// context are unowned views of 64-byte aligned buffers in an arena created
+/// into \p arena, which must outlive the contexts. Each input holds a copy
+/// of \p inputImageData. Falls back to setupContextPool() if the arena cannot
+/// be mapped.
+std::vector<std::unique_ptr<ExecutionContext>>
+setupArenaContextPool(const std::vector<Placeholder *> &outputPHV,
+                      Placeholder *inputImagePH, Tensor &inputImageData,
+                      std::unique_ptr<PlaceholderArena> &arena) {
+  const unsigned numContexts =
+      miniBatch ? std::min<unsigned>(poolSize, iterationsOpt / miniBatch) : 1;
+  const size_t inputBytes = inputImageData.getSizeInBytes();
+  size_t contextBytes = PlaceholderArena::alignedSize(inputBytes);
+  for (auto *outputPH : outputPHV) {
+    contextBytes +=
+        PlaceholderArena::alignedSize(outputPH->getType()->getSizeInBytes());
+  }
+  arena = glow::make_unique<PlaceholderArena>(numContexts * contextBytes);
+  if (numContexts && !arena->capacity()) {
+    LOG(INFO) << "Failed to map the context pool arena, using heap tensors.";
+    return setupContextPool(outputPHV, inputImagePH, inputImageData);
+  }
+
+  std::vector<std::unique_ptr<ExecutionContext>> contexts;
+  for (unsigned i = 0; i < numContexts; i++) {
+    auto context = glow::make_unique<ExecutionContext>();
+    context->setTraceContext(glow::make_unique<TraceContext>(traceLevel));
+    PlaceholderBindings &bindings = *context->getPlaceholderBindings();
+    Tensor input(arena->allocate(inputBytes), &inputImageData.getType());
+    std::memcpy(input.getUnsafePtr(), inputImageData.getUnsafePtr(),
+                inputBytes);
+    bindings.insert(inputImagePH, std::move(input));
+    for (auto *outputPH : outputPHV) {
+      bindings.insert(outputPH,
+                      Tensor(arena->allocate(
+                                 outputPH->getType()->getSizeInBytes()),
+                             outputPH->getType()));
+    }
+    contexts.push_back(std::move(context));
+  }
+  return contexts;
+}
+
+llvm::cl::OptionCategory workerCat("Worker Thread Options");
+
+llvm::cl::opt<bool> shareCompiledFunction(
+    "share-compiled-function",
+    llvm::cl::desc("Compile the model once into a single HostManager shared by "
+                   "all minibatch worker threads, each of which only owns an "
+                   "ExecutionContext. Saves N-1 compilations with "
+                   "-minibatch-threads=N. The HostManager gets at least N "
+                   "devices and the function is placed on all of them, so "
+                   "the workers' inferences run in parallel."),
+    llvm::cl::Optional, llvm::cl::init(false), llvm::cl::cat(workerCat));
+
+/// How minibatches are distributed over the worker threads.
+enum class MiniBatchScheduler {
+  /// Each worker gets a fixed contiguous range of minibatches up front.
+  Static,
+  /// Workers take the next unprocessed minibatch from a shared atomic cursor.
+  Dynamic,
+};
+
+llvm::cl::opt<MiniBatchScheduler> miniBatchScheduler(
+    "minibatch-scheduler",
+    llvm::cl::desc("How minibatches are distributed over the worker threads."),
+    llvm::cl::values(clEnumValN(MiniBatchScheduler::Static, "static",
+                                "Split the minibatches into equal contiguous "
+                                "ranges, one per thread (default)."),
+                     clEnumValN(MiniBatchScheduler::Dynamic, "dynamic",
+                                "Hand out minibatches one at a time from a "
+                                "shared cursor, so faster threads take more.")),
+    llvm::cl::Optional, llvm::cl::init(MiniBatchScheduler::Static),
+    llvm::cl::cat(workerCat));
+
+llvm::cl::opt<CpuPlacement> workerAffinity(
+    "worker-affinity",
+    llvm::cl::desc("How worker threads are pinned to CPUs. Pinned workers "
+                   "allocate their buffers and their slice of the preloaded "
+                   "inputs on their own NUMA node."),
+    llvm::cl::values(
+        clEnumValN(CpuPlacement::None, "none", "Do not pin (default)."),
+        clEnumValN(CpuPlacement::Compact, "compact",
+                   "Fill one NUMA node before the next, hyperthread "
+                   "siblings adjacent."),
+        clEnumValN(CpuPlacement::Scatter, "scatter",
+                   "Spread workers round-robin over the NUMA nodes, physical "
+                   "cores before their siblings."),
+        clEnumValN(CpuPlacement::PhysicalCore, "physical-core",
+                   "One worker per physical core."),
+        clEnumValN(CpuPlacement::List, "list",
+                   "Pin worker i to the i-th CPU of -worker-cpus.")),
+    llvm::cl::Optional, llvm::cl::init(CpuPlacement::None),
+    llvm::cl::cat(workerCat));
+
+llvm::cl::opt<std::string> workerCpuList(
+    "worker-cpus",
+    llvm::cl::desc("CPUs for -worker-affinity=list, e.g. 0-3,8,10-11."),
+    llvm::cl::value_desc("list"), llvm::cl::Optional,
+    llvm::cl::cat(workerCat));
+
+llvm::cl::opt<bool> prefetchInputs(
+    "prefetch-inputs",
+    llvm::cl::desc("In minibatch mode without -preload-all-images, load and "
+                   "preprocess the next minibatch on a helper thread while the "
+                   "current one is being inferred."),
+    llvm::cl::Optional, llvm::cl::init(false), llvm::cl::cat(workerCat));
+
+/// Loads and preprocesses the inputs in filenames into data.
+using InputLoadFn =
+    std::function<void(const std::vector<std::string> &filenames, Tensor &data)>;
+
+/// Double-buffered loader of minibatch inputs. While the caller works on the
+/// current minibatch the next one is claimed and loaded into a second Tensor
+/// by a helper thread, which lives as long as the prefetcher; next() waits
+/// for it and swaps the buffers. The helper starts with the prefetcher, so
+/// its creation can be placed apart from setSource(), which must be called
+/// before next().
+class InputPrefetcher {
+public:
+  /// Claims the next minibatch, storing its image filenames and the image
+  /// index just past its end. \returns false if there is none left.
+  using ClaimFn =
+      std::function<bool(std::vector<std::string> &filenames, size_t &endId)>;
+
+  InputPrefetcher() : helper_([this]() { loadRequests(); }) {}
+
+  ~InputPrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    helper_.join();
+  }
+
+  InputPrefetcher(const InputPrefetcher &) = delete;
+  InputPrefetcher &operator=(const InputPrefetcher &) = delete;
+
+  /// Sets how minibatches are claimed, and how the helper loads them.
+  void setSource(ClaimFn claim, InputLoadFn load) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    claim_ = std::move(claim);
+    load_ = std::move(load);
+  }
+
+  /// Makes the next minibatch current by swapping it into \p data,
+  /// \p filenames and \p endId, then starts loading the one after it.
+  /// \returns false once all minibatches have been handed out.
+  bool next(Tensor &data, std::vector<std::string> &filenames, size_t &endId) {
+    if (!started_) {
+      started_ = true;
+      prefetch();
+    }
+    if (!pending_) {
+      return false;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [&]() { return !loadRequested_; });
+    }
+    pending_ = false;
+    std::swap(data, back_);
+    filenames.swap(backFilenames_);
+    endId = backEndId_;
+    prefetch();
+    return true;
+  }
+
+private:
+  /// Claims the next minibatch and has the helper thread load it into the
+  /// back buffer.
+  void prefetch() {
+    if (!claim_(backFilenames_, backEndId_)) {
+      return;
+    }
+    pending_ = true;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      loadRequested_ = true;
+    }
+    cv_.notify_all();
+  }
+
+  /// Body of the helper thread: serves load requests until destruction.
+  void loadRequests() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      cv_.wait(lock, [&]() { return loadRequested_ || stopping_; });
+      if (!loadRequested_) {
+        return;
+      }
+      lock.unlock();
+      load_(backFilenames_, back_);
+      lock.lock();
+      loadRequested_ = false;
+      cv_.notify_all();
+    }
+  }
+
+  ClaimFn claim_;
+  InputLoadFn load_;
+  bool started_{false};
+  /// Whether a minibatch was claimed and not yet handed out by next().
+  bool pending_{false};
+  Tensor back_;
+  std::vector<std::string> backFilenames_;
+  size_t backEndId_{0};
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  /// Set by prefetch() and cleared by the helper once the back buffer is
+  /// loaded; guarded by mutex_.
+  bool loadRequested_{false};
+  bool stopping_{false};
+  /// Declared last, so the members it uses exist before it starts.
+  std::thread helper_;
+};
+
+llvm::cl::opt<unsigned> preloadThreads(
+    "preload-threads",
+    llvm::cl::desc("Number of threads decoding and preprocessing images for "
+                   "-preload-all-images. 0 uses all hardware threads."),
+    llvm::cl::Optional, llvm::cl::init(0), llvm::cl::cat(workerCat));
+
+/// Loads all \p filenames into \p data with \p load using up to
+/// \p numThreads threads. The first input is loaded up front to learn the
+/// per-input shape; then every thread loads a contiguous range of the rest in
+/// small chunks and copies each chunk into its own disjoint slice of \p data,
+/// which is contiguous since the batch dimension is outermost.
+void loadInputsInParallel(llvm::ArrayRef<std::string> filenames, Tensor &data,
+                          unsigned numThreads, const InputLoadFn &load) {
+  constexpr size_t chunkSize = 64;
+  const size_t numInputs = filenames.size();
+  CHECK_GT(numInputs, 0) << "No inputs to load.";
+
+  Tensor first;
+  load({filenames.front()}, first);
+  ShapeVector dims(first.dims().begin(), first.dims().end());
+  const size_t inputBytes = first.getSizeInBytes() / dims[0];
+  dims[0] = numInputs;
+  data.reset(first.getElementType(), dims);
+  std::memcpy(data.getUnsafePtr(), first.getUnsafePtr(), inputBytes);
+
+  const size_t rest = numInputs - 1;
+  numThreads = std::max<size_t>(1, std::min<size_t>(numThreads, rest));
+  const size_t perThread = (rest + numThreads - 1) / numThreads;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < numThreads; t++) {
+    const size_t begin = 1 + t * perThread;
+    const size_t end = std::min(numInputs, begin + perThread);
+    threads.emplace_back([&, begin, end]() {
+      std::vector<std::string> chunkFilenames;
+      Tensor chunk;
+      for (size_t i = begin; i < end; i += chunkSize) {
+        const size_t chunkEnd = std::min(end, i + chunkSize);
+        chunkFilenames.assign(filenames.begin() + i,
+                              filenames.begin() + chunkEnd);
+        load(chunkFilenames, chunk);
+        CHECK(chunk.getSizeInBytes() == (chunkEnd - i) * inputBytes)
+            << "All preloaded inputs must have the same shape.";
+        std::memcpy(data.getUnsafePtr() + i * inputBytes, chunk.getUnsafePtr(),
+                    chunk.getSizeInBytes());
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+}
+
+llvm::cl::OptionCategory inputCat("Input Loading Options");
+
+llvm::cl::opt<std::string> inputCacheDir(
+    "input-cache-dir",
+    llvm::cl::desc("Directory of a persistent cache of preprocessed input "
+                   "tensors. Decoded and preprocessed images are stored there "
+                   "and later runs map them instead of decoding again. Entries "
+                   "are keyed by file path, mtime, size and the image "
+                   "preprocessing options."),
+    llvm::cl::value_desc("dir"), llvm::cl::Optional, llvm::cl::cat(inputCat));
+
+/// \returns a string describing the image preprocessing options, used as part
+/// of the input cache key. Besides the parsed normalization, channel order
+/// and layout, it holds every option of the command line \p args that is
+/// registered in the category of -image-mode, where the image loader keeps
+/// all of its options (input layout, mean, standard deviation, ...), and
+/// -fast-image-preprocess, as given.
+std::string getImagePreprocessingKey(llvm::ArrayRef<std::string> args) {
+  std::string key;
+  llvm::raw_string_ostream os(key);
+  os << "norm";
+  for (auto mode : imageNormMode) {
+    os << ":" << static_cast<int>(mode);
+  }
+  os << ";order";
+  for (auto order : imageChannelOrder) {
+    os << ":" << static_cast<int>(order);
+  }
+  os << ";layout";
+  for (auto layout : imageLayout) {
+    os << ":" << static_cast<int>(layout);
+  }
+
+  auto &options = llvm::cl::getRegisteredOptions();
+  auto findOption = [&](llvm::StringRef name) -> llvm::cl::Option * {
+    auto it = options.find(name);
+    return it == options.end() ? nullptr : it->getValue();
+  };
+  const llvm::cl::Option *imageMode = findOption("image-mode");
+  auto affectsPreprocessing = [&](const llvm::cl::Option &opt) {
+    if (opt.ArgStr == "fast-image-preprocess") {
+      return true;
+    }
+    if (!imageMode) {
+      return false;
+    }
+    for (const auto *cat : opt.Categories) {
+      if (std::find(imageMode->Categories.begin(), imageMode->Categories.end(),
+                    cat) != imageMode->Categories.end()) {
+        return true;
+      }
+    }
+    return false;
+  };
+  for (size_t i = 1; i < args.size(); i++) {
+    llvm::StringRef arg = args[i];
+    if (!arg.startswith("-") || arg == "-") {
+      continue;
+    }
+    const llvm::cl::Option *opt = findOption(arg.ltrim('-').split('=').first);
+    if (!opt || !affectsPreprocessing(*opt)) {
+      continue;
+    }
+    os << ";" << arg;
+    if (!arg.contains('=') &&
+        opt->getValueExpectedFlag() == llvm::cl::ValueRequired &&
+        i + 1 < args.size()) {
+      os << " " << args[++i];
+    }
+  }
+  return os.str();
+}
+
+llvm::cl::opt<unsigned> inflightRequests(
+    "inflight-requests",
+    llvm::cl::desc("Number of inference requests each worker keeps in flight "
+                   "through the asynchronous HostManager API, each with its "
+                   "own ExecutionContext. 1 runs requests one at a time."),
+    llvm::cl::Optional, llvm::cl::init(1), llvm::cl::cat(workerCat));
+
+/// Keeps several inference requests of one worker in flight on a HostManager.
+/// Every completion callback records the latency of its request and, while
+/// runs remain, immediately re-issues its ExecutionContext, so host-side work
+/// for one request overlaps backend compute of the others.
+class InflightRunner {
+public:
+  InflightRunner(runtime::HostManager &hostManager, llvm::StringRef function)
+      : hostManager_(hostManager), function_(function.str()) {}
+
+  /// Runs \p numRuns inferences spread over \p contexts, keeping up to
+  /// contexts.size() in flight, and blocks until all of them completed. The
+  /// submit-to-completion time of every run is appended to \p runTimesNs if
+  /// given. \returns false if any run failed.
+  bool run(std::vector<std::unique_ptr<ExecutionContext>> &contexts,
+           unsigned numRuns, std::vector<uint64_t> *runTimesNs) {
+    std::vector<std::unique_ptr<ExecutionContext>> toSubmit;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      runTimesNs_ = runTimesNs;
+      target_ = numRuns;
+      issued_ = std::min<size_t>(numRuns, contexts.size());
+      completed_ = 0;
+      failed_ = false;
+      for (auto &context : contexts) {
+        (toSubmit.size() < issued_ ? toSubmit : idle_)
+            .push_back(std::move(context));
+      }
+    }
+    contexts.clear();
+    for (auto &context : toSubmit) {
+      submit(std::move(context));
+    }
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [&]() { return completed_ == issued_; });
+    contexts = std::move(idle_);
+    idle_.clear();
+    return !failed_;
+  }
+
+  /// \returns whether any run has completed yet, and if so stores its
+  /// submit-to-completion time in \p ns and its completion time in \p end.
+  bool getFirstRun(uint64_t &ns, LatencyClock::time_point &end) {
+    std::lock_guard<std::mutex> lock(mu_);
+    ns = firstRunNs_;
+    end = firstRunEnd_;
+    return firstRunNs_ != 0;
+  }
+
+private:
+  void submit(std::unique_ptr<ExecutionContext> context) {
+    const auto start = LatencyClock::now();
+    hostManager_.runNetwork(
+        function_, std::move(context),
+        [this, start](runtime::RunIdentifierTy, Error err,
+                      std::unique_ptr<ExecutionContext> context) {
+          const auto end = LatencyClock::now();
+          const uint64_t ns = std::max<uint64_t>(latencyNs(start, end), 1);
+          const bool failed = ERR_TO_BOOL(std::move(err));
+          std::unique_lock<std::mutex> lock(mu_);
+          failed_ |= failed;
+          if (!failed && !firstRunNs_) {
+            firstRunNs_ = ns;
+            firstRunEnd_ = end;
+          }
+          if (runTimesNs_) {
+            runTimesNs_->push_back(ns);
+          }
+          completed_++;
+          if (!failed_ && issued_ < target_) {
+            issued_++;
+            lock.unlock();
+            submit(std::move(context));
+            return;
+          }
+          idle_.push_back(std::move(context));
+          cv_.notify_all();
+        });
+  }
+
+  runtime::HostManager &hostManager_;
+  std::string function_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::vector<std::unique_ptr<ExecutionContext>> idle_;
+  std::vector<uint64_t> *runTimesNs_{nullptr};
+  size_t target_{0};
+  size_t issued_{0};
+  size_t completed_{0};
+  bool failed_{false};
+  uint64_t firstRunNs_{0};
+  LatencyClock::time_point firstRunEnd_;
+};
+
+llvm::cl::OptionCategory traceCat("Trace Collection Options");
+
+llvm::cl::opt<unsigned> traceRingSize(
+    "trace-ring-size",
+    llvm::cl::desc("Capacity in events of the per-worker lock-free ring that "
+                   "trace events pass through on their way to the trace "
+                   "writer thread."),
+    llvm::cl::Optional, llvm::cl::init(1 << 16), llvm::cl::cat(traceCat));
+
+llvm::cl::opt<unsigned> traceMemoryCapMB(
+    "trace-memory-cap-mb",
+    llvm::cl::desc("Megabytes of formatted trace events buffered before they "
+                   "are appended to the trace file. The trace is streamed to "
+                   "-trace-path during the run instead of being written at "
+                   "exit, so this bounds the memory tracing uses."),
+    llvm::cl::Optional, llvm::cl::init(16), llvm::cl::cat(traceCat));
+
+llvm::cl::opt<bool> operatorProfile(
+    "op-profile",
+    llvm::cl::desc("Aggregate the operator events of -auto-instrument by node "
+                   "kind and name while running and print the operators with "
+                   "the highest self time at exit. Needs no -trace-path."),
+    llvm::cl::Optional, llvm::cl::init(false), llvm::cl::cat(traceCat));
+
+llvm::cl::opt<unsigned> operatorProfileTop(
+    "op-profile-top",
+    llvm::cl::desc("Number of operators printed by -op-profile, 0 for all."),
+    llvm::cl::Optional, llvm::cl::init(20), llvm::cl::cat(traceCat));
+
+llvm::cl::opt<std::string> operatorProfileCSVPath(
+    "op-profile-csv",
+    llvm::cl::desc("Write the per-operator profile of every operator as CSV "
+                   "to this file. Implies -op-profile."),
+    llvm::cl::value_desc("file.csv"), llvm::cl::Optional,
+    llvm::cl::cat(traceCat));
+
+llvm::cl::opt<unsigned> outputQueueDepth(
+    "output-queue-depth",
+    llvm::cl::desc("With several workers, the number of minibatch outputs per "
+                   "worker that may wait to be post-processed. A worker "
+                   "whose outputs would exceed it waits for the "
+                   "post-processing thread to catch up."),
+    llvm::cl::Optional, llvm::cl::init(4), llvm::cl::cat(workerCat));
+
+/// Outputs of one minibatch handed from a worker to the post-processing
+/// thread, so that workers never wait for each other's printing.
+struct DeferredOutputs {
+  size_t threadId;
+  /// Index of the minibatch, by which the results are printed.
+  size_t miniBatchNumber;
+  std::vector<std::string> filenames;
+  std::unique_ptr<PlaceholderBindings> bindings;
+};
+
+/// Runs \p fn with everything it writes to standard output, through
+/// llvm::outs(), stdio or iostreams, captured into \p captured instead of
+/// printed. Nothing else may print meanwhile. \returns what \p fn returns.
+int captureStdout(const std::function<int()> &fn, std::string &captured) {
+  captured.clear();
+  llvm::outs().flush();
+  std::cout.flush();
+  fflush(stdout);
+  FILE *file = tmpfile();
+  const int savedFd = file ? dup(STDOUT_FILENO) : -1;
+  if (savedFd < 0 || dup2(fileno(file), STDOUT_FILENO) < 0) {
+    if (savedFd >= 0) {
+      close(savedFd);
+    }
+    if (file) {
+      fclose(file);
+    }
+    return fn();
+  }
+  const int result = fn();
+  llvm::outs().flush();
+  std::cout.flush();
+  fflush(stdout);
+  dup2(savedFd, STDOUT_FILENO);
+  close(savedFd);
+  rewind(file);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+    captured.append(buf, n);
+  }
+  fclose(file);
+  return result;
+}
+
+/// Post-processes the outputs of several workers on one consumer thread while
+/// the workers keep running. Outputs are processed as they arrive, and what
+/// processing prints is kept per minibatch; finish() prints it ordered by
+/// minibatch index, and by worker for equal indices, so the output is the
+/// same as with one worker. Only that text waits for its turn. Output
+/// tensors are not copied: takeOutputs() swaps them out of the worker's
+/// bindings for a set the consumer recycles. At most capacity sets wait to
+/// be processed, beyond which push() blocks.
+class DeferredOutputQueue {
+public:
+  /// Post-processes outputs and stores what it printed into the string.
+  using ProcessFn = std::function<void(DeferredOutputs &, std::string &)>;
+
+  DeferredOutputQueue(size_t numWorkers, size_t capacity, ProcessFn process)
+      : numWorkers_(numWorkers), capacity_(std::max<size_t>(capacity, 1)),
+        process_(std::move(process)), spares_(numWorkers) {
+    consumer_ = std::thread([this]() { consume(); });
+  }
+
+  ~DeferredOutputQueue() { finish(); }
+
+  /// \returns the tensors of \p outputPHs of \p worker, moved out of
+  /// \p bindings, which gets recycled tensors of the same types instead.
+  std::unique_ptr<PlaceholderBindings>
+  takeOutputs(size_t worker, PlaceholderBindings &bindings,
+              llvm::ArrayRef<Placeholder *> outputPHs) {
+    std::unique_ptr<PlaceholderBindings> outputs;
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (!spares_[worker].empty()) {
+        outputs = std::move(spares_[worker].back());
+        spares_[worker].pop_back();
+      }
+    }
+    if (!outputs) {
+      outputs = glow::make_unique<PlaceholderBindings>();
+      for (Placeholder *PH : outputPHs) {
+        outputs->insert(PH, Tensor(*PH->getType()));
+      }
+    }
+    for (Placeholder *PH : outputPHs) {
+      std::swap(*outputs->get(PH), *bindings.get(PH));
+    }
+    return outputs;
+  }
+
+  /// Queues \p outputs, waiting while capacity sets are queued.
+  void push(DeferredOutputs outputs) {
+    std::unique_lock<std::mutex> lock(mu_);
+    spaceCv_.wait(lock, [&]() { return queue_.size() < capacity_; });
+    queue_.push_back(std::move(outputs));
+    readyCv_.notify_one();
+  }
+
+  /// Tells the consumer that one more worker will not push any more outputs.
+  void workerExited() {
+    std::lock_guard<std::mutex> lock(mu_);
+    numExited_++;
+    readyCv_.notify_one();
+  }
+
+  /// Waits until all outputs were processed and prints their results in
+  /// minibatch order. Every worker must have exited.
+  void finish() {
+    if (!consumer_.joinable()) {
+      return;
+    }
+    consumer_.join();
+    for (const auto &result : results_) {
+      llvm::outs() << result.second;
+    }
+    llvm::outs().flush();
+    results_.clear();
+  }
+
+private:
+  void consume() {
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true) {
+      readyCv_.wait(lock, [&]() {
+        return !queue_.empty() || numExited_ == numWorkers_;
+      });
+      if (queue_.empty()) {
+        return;
+      }
+      DeferredOutputs outputs = std::move(queue_.front());
+      queue_.pop_front();
+      spaceCv_.notify_all();
+      lock.unlock();
+      std::string printed;
+      process_(outputs, printed);
+      lock.lock();
+      results_.emplace(
+          std::make_pair(outputs.miniBatchNumber, outputs.threadId),
+          std::move(printed));
+      spares_[outputs.threadId].push_back(std::move(outputs.bindings));
+    }
+  }
+
+  const size_t numWorkers_;
+  const size_t capacity_;
+  ProcessFn process_;
+  std::mutex mu_;
+  std::condition_variable readyCv_;
+  std::condition_variable spaceCv_;
+  std::deque<DeferredOutputs> queue_;
+  /// Recycled output tensors of every worker.
+  std::vector<std::vector<std::unique_ptr<PlaceholderBindings>>> spares_;
+  /// What post-processing printed, by minibatch index and worker.
+  std::map<std::pair<size_t, size_t>, std::string> results_;
+  size_t numExited_{0};
+  std::thread consumer_;
+};
+
+/// Load balancing statistics of one worker thread.
+struct WorkerStats {
+  size_t miniBatches{0};
+  /// Time spent creating the Loader and compiling, or waiting for the
+  /// shared function to be compiled.
+  uint64_t setupNs{0};
+  /// Time spent waiting for work: claiming a minibatch, waiting for a
+  /// prefetched one or for the next stream or open-loop request.
+  uint64_t idleNs{0};
+  LatencyClock::time_point start;
+  LatencyClock::time_point end;
+};
+
+/// Prints how many minibatches each worker processed, how its lifetime split
+/// into setup, busy and idle time, and how long before \p runEnd it was done.
+void printWorkerStats(llvm::ArrayRef<WorkerStats> stats,
+                      LatencyClock::time_point runStart,
+                      LatencyClock::time_point runEnd) {
+  const double wallTime = latencyNs(runStart, runEnd) / 1e9;
+  llvm::outs() << llvm::formatv("Worker load balance ({0} scheduler, wall "
+                                "time {1:f4} s):\n",
+                                miniBatchScheduler == MiniBatchScheduler::Dynamic
+                                    ? "dynamic"
+                                    : "static",
+                                wallTime);
+  for (size_t i = 0, e = stats.size(); i < e; i++) {
+    const uint64_t lifetimeNs = latencyNs(stats[i].start, stats[i].end);
+    const uint64_t waitNs = stats[i].setupNs + stats[i].idleNs;
+    const double busy = (lifetimeNs > waitNs ? lifetimeNs - waitNs : 0) / 1e9;
+    llvm::outs() << llvm::formatv(
+        "  thread {0}: {1} minibatches, setup {2:f4} s, busy {3:f4} s, idle "
+        "{4:f4} s, done {5:f4} s before the end\n",
+        i, stats[i].miniBatches, stats[i].setupNs / 1e9, busy,
+        stats[i].idleNs / 1e9, latencyNs(stats[i].end, runEnd) / 1e9);
+  }
+}
+
+llvm::cl::OptionCategory openLoopCat("Open-Loop Load Generator Options");
+
+llvm::cl::opt<double> openLoopQPS(
+    "open-loop-qps",
+    llvm::cl::desc("Run an open-loop benchmark: requests arrive at this rate "
+                   "regardless of completions, are queued and served by the "
+                   "worker threads, and latency is measured from arrival. "
+                   "0 disables the mode."),
+    llvm::cl::Optional, llvm::cl::init(0.0), llvm::cl::cat(openLoopCat));
+
+/// Distribution of the time between two open-loop request arrivals.
+enum class ArrivalDistribution { Poisson, Constant };
+
+llvm::cl::opt<ArrivalDistribution> openLoopArrivals(
+    "open-loop-arrivals",
+    llvm::cl::desc("Distribution of open-loop request inter-arrival times."),
+    llvm::cl::values(clEnumValN(ArrivalDistribution::Poisson, "poisson",
+                                "Exponentially distributed (default)."),
+                     clEnumValN(ArrivalDistribution::Constant, "constant",
+                                "Fixed interval of 1/qps.")),
+    llvm::cl::Optional, llvm::cl::init(ArrivalDistribution::Poisson),
+    llvm::cl::cat(openLoopCat));
+
+llvm::cl::opt<unsigned> openLoopRequests(
+    "open-loop-requests",
+    llvm::cl::desc("Number of requests issued in open-loop mode."),
+    llvm::cl::Optional, llvm::cl::init(1000), llvm::cl::cat(openLoopCat));
+
+llvm::cl::opt<unsigned> openLoopSeed(
+    "open-loop-seed",
+    llvm::cl::desc("Seed of the open-loop arrival time generator."),
+    llvm::cl::Optional, llvm::cl::init(0), llvm::cl::cat(openLoopCat));
+
+/// Queue of open-loop request arrival times, filled by the load generator and
+/// drained by the worker threads.
+class OpenLoopQueue {
+public:
+  /// Called by a worker once it is ready to serve requests.
+  void workerReady() {
+    std::lock_guard<std::mutex> lock(mu_);
+    ready_++;
+    cv_.notify_all();
+  }
+
+  /// Called by a worker when it returns, whether or not it served requests.
+  void workerExited() {
+    std::lock_guard<std::mutex> lock(mu_);
+    exited_++;
+    cv_.notify_all();
+  }
+
+  /// Issues \p numRequests requests at \p qps once all \p numWorkers have
+  /// either become ready or exited, then closes the queue. Every request is
+  /// stamped with its scheduled arrival time so that generator hiccups do not
+  /// hide queueing delay. \returns the time the first request was due.
+  LatencyClock::time_point generate(size_t numWorkers, double qps,
+                                    ArrivalDistribution dist,
+                                    unsigned numRequests, unsigned seed) {
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      cv_.wait(lock, [&]() { return ready_ + exited_ >= numWorkers; });
+    }
+    std::mt19937_64 rng(seed);
+    std::exponential_distribution<double> expDist(qps);
+    const auto start = LatencyClock::now();
+    auto arrival = start;
+    for (unsigned i = 0; i < numRequests; i++) {
+      const double interval =
+          dist == ArrivalDistribution::Poisson ? expDist(rng) : 1.0 / qps;
+      arrival += std::chrono::duration_cast<LatencyClock::duration>(
+          std::chrono::duration<double>(interval));
+      std::this_thread::sleep_until(arrival);
+      std::lock_guard<std::mutex> lock(mu_);
+      arrivals_.push(arrival);
+      cv_.notify_one();
+    }
+    std::lock_guard<std::mutex> lock(mu_);
+    closed_ = true;
+    cv_.notify_all();
+    return start;
+  }
+
+  /// Blocks until a request is available and stores its arrival time in
+  /// \p arrival. \returns false once the queue is closed and drained.
+  bool pop(LatencyClock::time_point &arrival) {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [&]() { return closed_ || !arrivals_.empty(); });
+    if (arrivals_.empty()) {
+      return false;
+    }
+    arrival = arrivals_.front();
+    arrivals_.pop();
+    return true;
+  }
+
+private:
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::queue<LatencyClock::time_point> arrivals_;
+  size_t ready_{0};
+  size_t exited_{0};
+  bool closed_{false};
+};
+
+llvm::cl::OptionCategory dynamicBatchCat("Dynamic Batching Options");
+
+llvm::cl::opt<unsigned> dynamicBatchSize(
+    "dynamic-batch-size",
+    llvm::cl::desc("In stream input mode, compile the model for this batch "
+                   "size and group incoming requests (lines of image "
+                   "filenames on stdin) into batches of up to this many "
+                   "images. Partial batches are zero padded. 0 disables "
+                   "dynamic batching."),
+    llvm::cl::Optional, llvm::cl::init(0), llvm::cl::cat(dynamicBatchCat));
+
+llvm::cl::opt<unsigned> dynamicBatchTimeoutUs(
+    "dynamic-batch-timeout-us",
+    llvm::cl::desc("Maximum time in microseconds the oldest request of a "
+                   "dynamic batch waits for more requests before the batch "
+                   "is run."),
+    llvm::cl::Optional, llvm::cl::init(1000), llvm::cl::cat(dynamicBatchCat));
+
+/// A request received in dynamic batching mode.
+struct BatchRequest {
+  std::vector<std::string> filenames;
+  LatencyClock::time_point arrival;
+};
+
+/// Queue between the stdin reader and the dynamic batcher.
+class BatchRequestQueue {
+public:
+  void push(BatchRequest request) {
+    std::lock_guard<std::mutex> lock(mu_);
+    requests_.push_back(std::move(request));
+    cv_.notify_one();
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mu_);
+    closed_ = true;
+    cv_.notify_one();
+  }
+
+  /// Collects the next batch into \p batch: waits for a first request, then
+  /// keeps adding requests while they fit in \p maxImages images and the
+  /// first request has waited less than \p timeout. \returns false once the
+  /// queue is closed and drained.
+  bool popBatch(std::vector<BatchRequest> &batch, size_t maxImages,
+                LatencyClock::duration timeout) {
+    batch.clear();
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [&]() { return closed_ || !requests_.empty(); });
+    if (requests_.empty()) {
+      return false;
+    }
+    const auto deadline = requests_.front().arrival + timeout;
+    size_t numImages = 0;
+    while (true) {
+      while (!requests_.empty() &&
+             numImages + requests_.front().filenames.size() <= maxImages) {
+        numImages += requests_.front().filenames.size();
+        batch.push_back(std::move(requests_.front()));
+        requests_.pop_front();
+      }
+      if (!requests_.empty() || numImages == maxImages || closed_ ||
+          !cv_.wait_until(lock, deadline, [&]() {
+            return closed_ || !requests_.empty();
+          })) {
+        break;
+      }
+    }
+    return true;
+  }
+
+private:
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<BatchRequest> requests_;
+  bool closed_{false};
+};
+
+/// A histogram written to the latency JSON under the key name.
+struct NamedLatencyHistogram {
+  const char *name;
+  const LatencyHistogram *hist;
+};
+
+/// Writes the non-empty histograms in \p hists, measured with \p numThreads
+/// workers running inferences through \p engine, as a JSON document to
+/// \p path. \returns false if the file could not be written.
+bool dumpLatencyJSON(llvm::StringRef path,
+                     llvm::ArrayRef<NamedLatencyHistogram> hists,
+                     size_t numThreads, llvm::StringRef engine) {
+  std::error_code EC;
+  llvm::raw_fd_ostream os(path, EC);
+  if (EC) {
+    llvm::errs() << "Failed to open " << path << ": " << EC.message() << "\n";
+    return false;
+  }
+  os << "{\n  \"model\": \"";
+  TraceWriter::writeEscaped(os, Loader::getModelOptPath());
+  os << "\",\n  \"engine\": \"";
+  TraceWriter::writeEscaped(os, engine);
+  os << "\",\n";
+  os << "  \"threads\": " << numThreads << ",\n";
+  os << "  \"warmup_runs\": " << latencyWarmupRuns << ",\n";
+  os << "  \"measured_runs\": " << latencyMeasuredRuns;
+  for (const auto &h : hists) {
+    if (h.hist->count()) {
+      os << ",\n  \"" << h.name << "\": ";
+      h.hist->dumpJSON(os);
+    }
+  }
+  os << "\n}\n";
+  return true;
+}
+
+llvm::cl::OptionCategory batchSweepCat("Batch Size Sweep Options");
+
+llvm::cl::list<unsigned> batchSweepSizes(
+    "batch-sweep",
+    llvm::cl::desc("Compile and benchmark the model for each of these batch "
+                   "sizes in turn, then print images/s and per-batch latency "
+                   "percentiles of each and recommend the knee of the "
+                   "throughput curve. Batches are filled by repeating the "
+                   "input images, which are loaded once."),
+    llvm::cl::value_desc("1,2,4,..."), llvm::cl::CommaSeparated,
+    llvm::cl::ZeroOrMore, llvm::cl::cat(batchSweepCat));
+
+llvm::cl::opt<std::string> batchSweepCSVPath(
+    "batch-sweep-csv",
+    llvm::cl::desc("Write the throughput/latency curve of -batch-sweep as CSV "
+                   "to this file."),
+    llvm::cl::value_desc("file.csv"), llvm::cl::Optional,
+    llvm::cl::cat(batchSweepCat));
+
+/// \returns a batch of \p batchSize images taken from \p inputs in order,
+/// starting over at the first image when \p inputs has fewer images.
+Tensor tileInputBatch(const Tensor &inputs, size_t batchSize) {
+  const size_t numImages = inputs.dims()[0];
+  const size_t imageBytes = inputs.getSizeInBytes() / numImages;
+  ShapeVector batchShape(inputs.dims().begin(), inputs.dims().end());
+  batchShape[0] = batchSize;
+  Tensor batch(Type::newShape(inputs.getType(), batchShape));
+  for (size_t i = 0; i < batchSize; i++) {
+    std::memcpy(batch.getUnsafePtr() + i * imageBytes,
+                inputs.getUnsafePtr() + (i % numImages) * imageBytes,
+                imageBytes);
+  }
+  return batch;
+}
+
+/// The model given by -m, compiled by a Loader for batches of one shape and
+/// run on one batch at a time. The batch sweep, the model list and
+/// -int8-compare benchmark through it, so they convert inputs, compile and
+/// time alike.
+class BatchBenchmark {
+public:
+  /// Compiles the model with \p loader for batches of type \p batchType.
+  BatchBenchmark(Loader &loader, const Type &batchType)
+      : loader_(loader), context_(glow::make_unique<ExecutionContext>()),
+        batchSize_(batchType.dims()[0]) {
+    const auto buildStart = LatencyClock::now();
+    inputOutputPair_ =
+        buildAndCompileAndGetInAndOutPair(loader_, bindings(), batchType);
+    compileNs_ = latencyNs(buildStart, LatencyClock::now());
+  }
+
+  /// \returns how long compiling the model took.
+  uint64_t compileNs() const { return compileNs_; }
+
+  PlaceholderBindings &bindings() {
+    return *context_->getPlaceholderBindings();
+  }
+
+  /// \returns the output placeholder, or nullptr if the model has several.
+  Placeholder *getSingleOutput() const {
+    return inputOutputPair_.second.size() == 1
+               ? inputOutputPair_.second.begin()->second
+               : nullptr;
+  }
+
+  /// Makes \p batch the input of the following runs, converted to FP16 with
+  /// -convert-inout-to-fp16.
+  void setInput(const Tensor &batch) {
+    input_ = convertInAndOutToFp16 ? getFloat16Copy(batch) : batch.clone();
+    updateInputPlaceholders(bindings(), {inputOutputPair_.first}, {&input_});
+  }
+
+  /// Runs the model once on the current input.
+  void run() { loader_.runInference(context_.get(), batchSize_); }
+
+  /// Runs the current input -latency-warmup times untimed, then times runs
+  /// into \p latency and prints their summary as \p label.
+  void time(LatencyHistogram &latency, llvm::StringRef label) {
+    for (unsigned i = 0; i < latencyWarmupRuns; i++) {
+      run();
+    }
+    llvm::outs() << timeRuns([&]() { run(); }, latency, label, 1);
+  }
+
+private:
+  Loader &loader_;
+  std::unique_ptr<ExecutionContext> context_;
+  size_t batchSize_;
+  std::pair<Placeholder *, llvm::StringMap<Placeholder *>> inputOutputPair_;
+  uint64_t compileNs_;
+  Tensor input_;
+};
+
+/// Sets the variable behind a command line option, such as -m or
+/// -dump-profile, for as long as it is in scope, and then restores the
+/// previous value however the scope is left.
+template <typename ValueT, typename OptionT = ValueT> class ScopedOptionValue {
+public:
+  ScopedOptionValue(OptionT &option, ValueT value)
+      : option_(option), saved_(option) {
+    option_ = std::move(value);
+  }
+  ~ScopedOptionValue() { option_ = saved_; }
+
+  ScopedOptionValue(const ScopedOptionValue &) = delete;
+  ScopedOptionValue &operator=(const ScopedOptionValue &) = delete;
+
+private:
+  OptionT &option_;
+  ValueT saved_;
+};
+
+/// Compiles the model with \p loader for \p batch and times runs on it into
+/// \p latency, reported as \p label. \returns the compile time in ns.
+uint64_t compileAndTimeBatch(Loader &loader, const Tensor &batch,
+                             llvm::StringRef label,
+                             LatencyHistogram &latency) {
+  BatchBenchmark benchmark(loader, batch.getType());
+  benchmark.setInput(batch);
+  benchmark.time(latency, label);
+  return benchmark.compileNs();
+}
+
+/// Runs -batch-sweep on the \p inputs images, preloaded as one tensor. The
+/// model is compiled for one batch size at a time by a fresh Loader, set up
+/// by \p addExtensions, which is destroyed before the next batch size is
+/// compiled, so only one copy of the weights is resident at any time.
+/// \returns the number of errors.
+int runBatchSweep(const Tensor &inputs,
+                  const std::function<void(Loader &)> &addExtensions) {
+  std::vector<unsigned> batchSizes(batchSweepSizes.begin(),
+                                   batchSweepSizes.end());
+  std::sort(batchSizes.begin(), batchSizes.end());
+  batchSizes.erase(std::unique(batchSizes.begin(), batchSizes.end()),
+                   batchSizes.end());
+  if (batchSizes.front() == 0) {
+    llvm::errs() << "-batch-sweep sizes must be positive.\n";
+    return 1;
+  }
+
+  std::vector<BatchSweepPoint> points;
+  for (unsigned batchSize : batchSizes) {
+    Tensor batch = tileInputBatch(inputs, batchSize);
+    Loader loader;
+    addExtensions(loader);
+    BatchSweepPoint point = {batchSize, 0, LatencyHistogram()};
+    point.compileNs = compileAndTimeBatch(
+        loader, batch, llvm::formatv("Batch size {0}", batchSize).str(),
+        point.latency);
+    llvm::outs() << llvm::formatv(
+        "Batch size {0}: {1:f2} images/s, compiled in {2:f3} s\n", batchSize,
+        point.imagesPerSecond(), point.compileNs / 1e9);
+    points.push_back(std::move(point));
+  }
+
+  printBatchSweep(llvm::outs(), points);
+  if (!batchSweepCSVPath.empty() &&
+      !dumpBatchSweepCSV(batchSweepCSVPath, points)) {
+    return 1;
+  }
+  return 0;
+}
+
+llvm::cl::opt<unsigned> threadSweepMax(
+    "thread-sweep",
+    llvm::cl::desc("Run the same workload, -latency-warmup untimed and "
+                   "-latency-runs timed minibatches of -minibatch images per "
+                   "worker, on 1, 2, 4, ... up to this many worker threads. "
+                   "Throughput, speedup, parallel efficiency and per-thread "
+                   "inference time inflation are reported. 0 disables the "
+                   "sweep."),
+    llvm::cl::Optional, llvm::cl::init(0), llvm::cl::cat(workerCat));
+
+llvm::cl::opt<std::string> threadSweepCSVPath(
+    "thread-sweep-csv",
+    llvm::cl::desc("Write the scaling curve of -thread-sweep as CSV to this "
+                   "file."),
+    llvm::cl::value_desc("file.csv"), llvm::cl::Optional,
+    llvm::cl::cat(workerCat));
+
+/// \returns the CPU time consumed by all threads of the process so far.
+uint64_t processCpuNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/// A worker slot of the thread sweep. Slots are set up by the first sweep
+/// point that uses them and then reused, so the model is compiled at most
+/// once per slot, or once in total with -share-compiled-function.
+struct ThreadSweepWorker {
+  std::unique_ptr<Loader> ownLoader;
+  Loader *loader{nullptr};
+  std::unique_ptr<ExecutionContext> context;
+  Tensor batch;
+};
+
+/// Runs -thread-sweep on minibatches tiled from the \p inputs images. Loaders
+/// are set up by \p addExtensions, and workers are placed by
+/// -worker-affinity, with \p cpuList for the list policy. \returns the
+/// number of errors.
+int runThreadSweep(const Tensor &inputs,
+                   const std::function<void(Loader &)> &addExtensions,
+                   llvm::ArrayRef<unsigned> cpuList) {
+  std::vector<unsigned> threadCounts;
+  for (unsigned n = 1; n < threadSweepMax; n *= 2) {
+    threadCounts.push_back(n);
+  }
+  threadCounts.push_back(threadSweepMax);
+
+  // As in executeNetwork(), the shared HostManager needs a device per worker
+  // for the workers to run concurrently.
+  if (shareCompiledFunction && numDevices < threadSweepMax) {
+    llvm::outs() << "Setting " << numDevices.ArgStr << " to "
+                 << threadSweepMax << " as required by "
+                 << shareCompiledFunction.ArgStr << ".\n";
+    numDevices.getValue() = threadSweepMax;
+  }
+
+  const CpuTopology topology = CpuTopology::detect();
+  const std::vector<unsigned> sweepCpus =
+      topology.place(workerAffinity, threadSweepMax, cpuList);
+  const Tensor batch = tileInputBatch(inputs, miniBatch);
+  std::unique_ptr<Loader> sharedLoader;
+  Placeholder *sharedInputPH = nullptr;
+  // Called on the worker thread, so its tensors are placed on its NUMA node
+  // when it is pinned. The first sweep point has a single worker, which
+  // compiles the shared function if there is one.
+  auto setUp = [&](ThreadSweepWorker &worker) {
+    worker.context = glow::make_unique<ExecutionContext>();
+    PlaceholderBindings &bindings = *worker.context->getPlaceholderBindings();
+    Placeholder *inputPH;
+    if (shareCompiledFunction && sharedLoader) {
+      bindings.allocate(sharedLoader->getModule()->getPlaceholders());
+      inputPH = sharedInputPH;
+      worker.loader = sharedLoader.get();
+    } else {
+      // The shared Loader is created by the first worker, which may be
+      // pinned to a single CPU, but its HostManager's threads serve all
+      // workers and must be free to use every worker's CPU.
+      {
+        ScopedThreadAffinity onWorkerCpus(
+            shareCompiledFunction ? llvm::ArrayRef<unsigned>(sweepCpus)
+                                  : llvm::ArrayRef<unsigned>());
+        worker.ownLoader = glow::make_unique<Loader>();
+      }
+      addExtensions(*worker.ownLoader);
+      inputPH = buildAndCompileAndGetInAndOutPair(*worker.ownLoader, bindings,
+                                                  batch.getType())
+                    .first;
+      worker.loader = worker.ownLoader.get();
+      if (shareCompiledFunction) {
+        sharedLoader = std::move(worker.ownLoader);
+        sharedInputPH = inputPH;
+      }
+    }
+    worker.batch =
+        convertInAndOutToFp16 ? getFloat16Copy(batch) : batch.clone();
+    updateInputPlaceholders(bindings, {inputPH}, {&worker.batch});
+  };
+
+  std::vector<ThreadSweepWorker> workers(threadCounts.back());
+  std::vector<ThreadSweepPoint> points;
+  for (unsigned numThreads : threadCounts) {
+    const std::vector<unsigned> placement =
+        topology.place(workerAffinity, numThreads, cpuList);
+    ThreadSweepPoint point = {numThreads, unsigned(miniBatch), 0, 0,
+                              std::vector<LatencyHistogram>(numThreads)};
+    std::vector<LatencyClock::time_point> starts(numThreads), ends(numThreads);
+    // Workers start their timed runs together, once all of them are set up
+    // and warmed up.
+    std::atomic<unsigned> ready{0};
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < numThreads; i++) {
+      threads.emplace_back([&, i]() {
+        if (!placement.empty() && !pinCurrentThread(placement[i])) {
+          llvm::errs() << "Failed to pin worker " << i << " to CPU "
+                       << placement[i] << "\n";
+        }
+        ThreadSweepWorker &worker = workers[i];
+        if (!worker.context) {
+          setUp(worker);
+        }
+        for (unsigned run = 0; run < latencyWarmupRuns; run++) {
+          worker.loader->runInference(worker.context.get(), miniBatch);
+        }
+        ready++;
+        while (ready.load() < numThreads) {
+          std::this_thread::yield();
+        }
+        starts[i] = LatencyClock::now();
+        for (unsigned run = 0; run < latencyMeasuredRuns; run++) {
+          const auto runStart = LatencyClock::now();
+          worker.loader->runInference(worker.context.get(), miniBatch);
+          point.perThread[i].record(latencyNs(runStart, LatencyClock::now()));
+        }
+        ends[i] = LatencyClock::now();
+      });
+    }
+    while (ready.load() < numThreads) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const uint64_t cpuStart = processCpuNs();
+    for (auto &t : threads) {
+      t.join();
+    }
+    point.cpuNs = processCpuNs() - cpuStart;
+    point.wallNs = latencyNs(*std::min_element(starts.begin(), starts.end()),
+                             *std::max_element(ends.begin(), ends.end()));
+    llvm::outs() << llvm::formatv("Threads {0}: {1:f2} images/s\n",
+                                  numThreads, point.imagesPerSecond());
+    points.push_back(std::move(point));
+  }
+
+  printThreadSweep(llvm::outs(), points);
+  if (!threadSweepCSVPath.empty() &&
+      !dumpThreadSweepCSV(threadSweepCSVPath, points)) {
+    return 1;
+  }
+  return 0;
+}
+
+llvm::cl::OptionCategory modelListCat("Model List Options");
+
+llvm::cl::opt<std::string> modelListFile(
+    "model-list",
+    llvm::cl::desc("Benchmark every model listed in this file, one per line, "
+                   "in sequence within this process instead of the model "
+                   "given by -m. Each model is compiled, warmed up and timed "
+                   "on its own."),
+    llvm::cl::value_desc("file"), llvm::cl::Optional,
+    llvm::cl::cat(modelListCat));
+
+llvm::cl::opt<std::string> modelListPrefix(
+    "model-list-prefix",
+    llvm::cl::desc("Prepended to every line of -model-list, e.g. ./models/"),
+    llvm::cl::Optional, llvm::cl::cat(modelListCat));
+
+llvm::cl::opt<std::string> modelListSuffix(
+    "model-list-suffix",
+    llvm::cl::desc("Appended to every line of -model-list, e.g. .onnx"),
+    llvm::cl::Optional, llvm::cl::cat(modelListCat));
+
+llvm::cl::opt<std::string> modelListResultsPath(
+    "model-list-results",
+    llvm::cl::desc("Write the compile time and latency of every model of "
+                   "-model-list as CSV to this file."),
+    llvm::cl::value_desc("file.csv"), llvm::cl::Optional,
+    llvm::cl::cat(modelListCat));
+
+/// Reads the model paths of -model-list into \p paths, skipping empty lines
+/// and lines starting with '#'. \returns false if the list cannot be read or
+/// names no model.
+bool readModelList(std::vector<std::string> &paths) {
+  std::ifstream file(modelListFile);
+  if (!file) {
+    llvm::errs() << "Failed to open -model-list " << modelListFile << "\n";
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    llvm::StringRef name = llvm::StringRef(line).trim();
+    if (!name.empty() && !name.startswith("#")) {
+      paths.push_back(modelListPrefix + name.str() + modelListSuffix);
+    }
+  }
+  if (paths.empty()) {
+    llvm::errs() << "-model-list " << modelListFile << " names no model\n";
+    return false;
+  }
+  return true;
+}
+
+/// Benchmarks the model given by -m on \p batch with a fresh Loader, set up
+/// by \p addExtensions. The model is listed as \p path in the output.
+/// \returns the CSV fields of the model for -model-list-results.
+std::string
+benchmarkListedModel(const Tensor &batch,
+                     const std::function<void(Loader &)> &addExtensions,
+                     llvm::StringRef path) {
+  const size_t batchSize = batch.dims()[0];
+  Loader loader;
+  addExtensions(loader);
+  LatencyHistogram latency;
+  const uint64_t compileNs =
+      compileAndTimeBatch(loader, batch, ("Model " + path).str(), latency);
+  llvm::outs() << llvm::formatv("Model {0}: compiled in {1:f3} s\n", path,
+                                compileNs / 1e9);
+  latency.printSummary(llvm::outs(), "  Inference");
+
+  std::string fields;
+  llvm::raw_string_ostream os(fields);
+  os << path << "," << batchSize
+     << llvm::formatv(",{0:f3},{1},{2},{3:f4},{4:f4}",
+                      LatencyHistogram::toMs(compileNs),
+                      unsigned(latencyWarmupRuns), latency.count(),
+                      latency.mean() / 1e6,
+                      LatencyHistogram::toMs(latency.min()));
+  for (const auto &p : reportedLatencyPercentiles) {
+    os << llvm::formatv(",{0:f4}",
+                        LatencyHistogram::toMs(latency.percentile(p.value)));
+  }
+  os << llvm::formatv(
+      ",{0:f4},{1:f2}", LatencyHistogram::toMs(latency.max()),
+      latency.mean() ? batchSize * 1e9 / latency.mean() : 0.0);
+  return os.str();
+}
+
+/// Runs \p benchmark in a child process and stores the text it returns into
+/// \p result. Glow reports a model it cannot import or compile by exiting
+/// or aborting, which thus only ends the child. \returns "ok", or how the
+/// child failed.
+std::string runInChildProcess(const std::function<std::string()> &benchmark,
+                              std::string &result) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return std::string("pipe failed: ") + strerror(errno);
+  }
+  // Output buffered now would otherwise be printed by both processes.
+  llvm::outs().flush();
+  llvm::errs().flush();
+  fflush(nullptr);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return std::string("fork failed: ") + strerror(errno);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    const std::string text = benchmark();
+    llvm::outs().flush();
+    llvm::errs().flush();
+    fflush(nullptr);
+    const char *buf = text.data();
+    size_t len = text.size();
+    while (len) {
+      const ssize_t n = write(fds[1], buf, len);
+      if (n <= 0) {
+        _exit(1);
+      }
+      buf += n;
+      len -= n;
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  result.clear();
+  char buf[4096];
+  for (;;) {
+    const ssize_t n = read(fds[0], buf, sizeof(buf));
+    if (n > 0) {
+      result.append(buf, n);
+    } else if (n == 0 || errno != EINTR) {
+      break;
+    }
+  }
+  close(fds[0]);
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  if (WIFSIGNALED(status)) {
+    return llvm::formatv("killed by signal {0}", WTERMSIG(status));
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return llvm::formatv("exit status {0}", WEXITSTATUS(status));
+  }
+  return "ok";
+}
+
+/// Benchmarks each model of \p paths on a batch tiled from the \p inputs
+/// images, of -minibatch images or all inputs. Each model runs in its own
+/// child process with a fresh Loader, and thus HostManager, set up by
+/// \p addExtensions, so no model's compilation or runs overlap with
+/// another's and a model that fails only loses its own results. Process
+/// startup and input loading are paid once. The -model-list-results row of
+/// each model is written as soon as it finishes. \returns 1 if any model
+/// failed.
+int runModelList(const Tensor &inputs,
+                 const std::function<void(Loader &)> &addExtensions,
+                 llvm::ArrayRef<std::string> paths) {
+  const size_t batchSize = miniBatch ? size_t(miniBatch) : inputs.dims()[0];
+  const Tensor batch = tileInputBatch(inputs, batchSize);
+
+  std::unique_ptr<llvm::raw_fd_ostream> csv;
+  if (!modelListResultsPath.empty()) {
+    std::error_code EC;
+    csv = glow::make_unique<llvm::raw_fd_ostream>(modelListResultsPath, EC);
+    if (EC) {
+      llvm::errs() << "Failed to open " << modelListResultsPath << ": "
+                   << EC.message() << "\n";
+      return 1;
+    }
+    *csv << "model,batch_size,compile_ms,warmup_runs,measured_runs,mean_ms,"
+            "min_ms";
+    for (const auto &p : reportedLatencyPercentiles) {
+      *csv << "," << llvm::StringRef(p.jsonKey).drop_back(3) << "_ms";
+    }
+    *csv << ",max_ms,images_per_second,status\n";
+    csv->flush();
+  }
+
+  unsigned numFailed = 0;
+  for (const auto &path : paths) {
+    // The Loader takes the model to import from the -m option.
+    ScopedOptionValue<std::vector<std::string>> modelPath(modelPathOpt,
+                                                          {path});
+    std::string fields;
+    const std::string status = runInChildProcess(
+        [&]() { return benchmarkListedModel(batch, addExtensions, path); },
+        fields);
+    if (status != "ok") {
+      llvm::errs() << "Model " << path << " failed: " << status << "\n";
+      numFailed++;
+      // Leave the measurements of the failed model empty.
+      fields = path + "," + std::to_string(batchSize) + ",,,,,";
+      fields.append(llvm::array_lengthof(reportedLatencyPercentiles) + 2,
+                    ',');
+    }
+    if (csv) {
+      *csv << fields << "," << status << "\n";
+      csv->flush();
+    }
+  }
+  if (numFailed) {
+    llvm::errs() << numFailed << " of " << paths.size()
+                 << " models failed\n";
+  }
+  return numFailed ? 1 : 0;
+}
+
+llvm::cl::opt<bool> fastImagePreprocess(
+    "fast-image-preprocess",
+    llvm::cl::desc("Decode 8-bit RGB and RGBA PNG inputs with libpng and "
+                   "normalize, reorder and lay them out in a single pass with "
+                   "SIMD kernels picked at run time. Other images are loaded "
+                   "as usual, and so are all images if the first batch does "
+                   "not match the regular preprocessing."),
+    llvm::cl::Optional, llvm::cl::init(false), llvm::cl::cat(inputCat));
+
+llvm::cl::opt<unsigned> preprocessBenchmarkRuns(
+    "preprocess-bench",
+    llvm::cl::desc("Only benchmark the preprocessing of the input images: "
+                   "run the regular loader and the kernels of "
+                   "-fast-image-preprocess this many times each, print their "
+                   "time per image and exit."),
+    llvm::cl::Optional, llvm::cl::init(0), llvm::cl::cat(inputCat));
+
+/// Preprocessing options of the model input in the form taken by the fused
+/// kernels of ImagePreprocess.h.
+struct FusedPreprocessOptions {
+  std::pair<float, float> range;
+  bool bgr;
+  bool nchw;
+};
+
+/// Fills \p options from -image-mode, -image-channel-order and -image-layout.
+/// \returns false if any of them is given for more than one input.
+bool getFusedPreprocessOptions(FusedPreprocessOptions &options) {
+  if (imageNormMode.size() > 1 || imageChannelOrder.size() > 1 ||
+      imageLayout.size() > 1) {
+    return false;
+  }
+  // Options that are not given take their default: 0to1, BGR and NCHW.
+  options.range = normModeToRange(imageNormMode.empty()
+                                      ? ImageNormalizationMode::k0to1
+                                      : imageNormMode[0]);
+  options.bgr = imageChannelOrder.empty() ||
+                imageChannelOrder[0] == ImageChannelOrder::BGR;
+  options.nchw = imageLayout.empty() || imageLayout[0] == ImageLayout::NCHW;
+  return true;
+}
+
+/// Preprocesses \p images, which must all have the same size, with the
+/// \p isa kernels into the batch \p data. The buffer of \p data is reused if
+/// it already has the right shape.
+void preprocessDecodedImages(llvm::ArrayRef<DecodedImage> images,
+                             const FusedPreprocessOptions &options,
+                             image_preprocess::Isa isa, Tensor &data) {
+  const dim_t n = images.size();
+  const dim_t h = images[0].height;
+  const dim_t w = images[0].width;
+  const dim_t c = ImagePreprocessor::numChannels;
+  const std::vector<dim_t> dims = options.nchw ? std::vector<dim_t>{n, c, h, w}
+                                               : std::vector<dim_t>{n, h, w, c};
+  if (data.isUnowned() || data.getElementType() != ElemKind::FloatTy ||
+      data.dims() != llvm::makeArrayRef(dims)) {
+    data = Tensor(ElemKind::FloatTy, dims);
+  }
+  float *out = reinterpret_cast<float *>(data.getUnsafePtr());
+  for (const auto &image : images) {
+    ImagePreprocessor(w, h, image.stride, options.range, options.bgr,
+                      options.nchw, isa)
+        .run(image.pixels.data(), out);
+    out += h * w * c;
+  }
+}
+
+/// Decodes the images in \p filenames and preprocesses them into \p data with
+/// the fused kernels. \returns false, leaving \p data untouched, if an image
+/// is not an 8-bit RGB or RGBA PNG, the images differ in size or the
+/// preprocessing options are not supported.
+bool loadImagesFused(const std::vector<std::string> &filenames, Tensor &data) {
+  FusedPreprocessOptions options;
+  if (filenames.empty() || !getFusedPreprocessOptions(options)) {
+    return false;
+  }
+  // Decode buffers are kept per thread, so loading a minibatch of the same
+  // size again does not allocate.
+  static thread_local std::vector<DecodedImage> images;
+  images.resize(filenames.size());
+  for (size_t i = 0; i < filenames.size(); i++) {
+    if (!decodePng(filenames[i], images[i]) ||
+        images[i].width != images[0].width ||
+        images[i].height != images[0].height) {
+      return false;
+    }
+  }
+  preprocessDecodedImages(images, options, image_preprocess::isa(), data);
+  return true;
+}
+
+/// \returns the largest absolute difference between the float tensors \p a
+/// and \p b, or infinity if their shapes differ.
+float getMaxAbsDifference(const Tensor &a, const Tensor &b) {
+  if (a.dims() != b.dims()) {
+    return std::numeric_limits<float>::infinity();
+  }
+  const float *pa = reinterpret_cast<const float *>(a.getUnsafePtr());
+  const float *pb = reinterpret_cast<const float *>(b.getUnsafePtr());
+  float diff = 0;
+  for (size_t i = 0, e = a.size(); i < e; i++) {
+    diff = std::max(diff, std::abs(pa[i] - pb[i]));
+  }
+  return diff;
+}
+
+/// Whether the fused kernels were checked against loadImagesAndPreprocess().
+/// They can disagree when the regular preprocessing applies options they do
+/// not implement, such as a mean and standard deviation.
+enum class FusedPreprocessState { Unchecked, Verified, Disabled };
+std::atomic<FusedPreprocessState> fusedPreprocessState{
+    FusedPreprocessState::Unchecked};
+std::mutex fusedPreprocessCheckMutex;
+
+/// Loads and preprocesses the images in \p filenames into \p data, with the
+/// fused kernels if -fast-image-preprocess is set and they can. The first
+/// batch they load is also loaded with loadImagesAndPreprocess(); if the two
+/// differ by more than rounding, the fused kernels are not used again.
+void preprocessImages(const std::vector<std::string> &filenames,
+                      Tensor &data) {
+  if (fastImagePreprocess) {
+    if (fusedPreprocessState == FusedPreprocessState::Verified &&
+        loadImagesFused(filenames, data)) {
+      return;
+    }
+    if (fusedPreprocessState == FusedPreprocessState::Unchecked) {
+      std::lock_guard<std::mutex> lock(fusedPreprocessCheckMutex);
+      if (fusedPreprocessState != FusedPreprocessState::Disabled &&
+          loadImagesFused(filenames, data)) {
+        if (fusedPreprocessState == FusedPreprocessState::Verified) {
+          return;
+        }
+        Tensor reference;
+        loadImagesAndPreprocess(filenames, &reference, imageNormMode,
+                                imageChannelOrder, imageLayout);
+        FusedPreprocessOptions options;
+        getFusedPreprocessOptions(options);
+        // Both compute v * scale + bias, with one or two roundings.
+        const float tolerance =
+            1e-6f * std::max(std::abs(options.range.first),
+                             std::abs(options.range.second));
+        const float diff = getMaxAbsDifference(data, reference);
+        if (diff <= tolerance) {
+          fusedPreprocessState = FusedPreprocessState::Verified;
+          return;
+        }
+        llvm::errs() << llvm::formatv(
+            "Warning: -fast-image-preprocess differs from the regular "
+            "preprocessing by up to {0}, falling back to it.\n",
+            diff);
+        fusedPreprocessState = FusedPreprocessState::Disabled;
+        data = std::move(reference);
+        return;
+      }
+    }
+  }
+  loadImagesAndPreprocess(filenames, &data, imageNormMode, imageChannelOrder,
+                          imageLayout);
+}
+
+/// Times loadImagesAndPreprocess() on \p filenames against the fused path of
+/// -fast-image-preprocess, end to end and split into libpng decoding and
+/// every kernel this CPU can run, each once untimed and then \p runs times.
+/// Prints the median time per image of every path, its speedup over the
+/// regular loader and the largest difference of its output from it.
+/// \returns 1 if the fused path cannot load the images.
+int runPreprocessBenchmark(const std::vector<std::string> &filenames,
+                           unsigned runs) {
+  using LH = LatencyHistogram;
+  FusedPreprocessOptions options;
+  Tensor reference, fused;
+  if (!getFusedPreprocessOptions(options) ||
+      !loadImagesFused(filenames, fused)) {
+    llvm::errs() << "-preprocess-bench needs 8-bit RGB or RGBA PNG inputs of "
+                    "one size and the preprocessing options of one input.\n";
+    return 1;
+  }
+  auto time = [&](const std::function<void()> &fn) {
+    LH hist;
+    fn();
+    for (unsigned i = 0; i < runs; i++) {
+      const auto start = LatencyClock::now();
+      fn();
+      hist.record(latencyNs(start, LatencyClock::now()));
+    }
+    return hist;
+  };
+  struct Row {
+    std::string path;
+    LH time;
+    /// Negative for paths whose output is not a preprocessed batch.
+    float diff;
+  };
+  std::vector<Row> rows;
+  rows.push_back({"loadImagesAndPreprocess", time([&] {
+                    loadImagesAndPreprocess(filenames, &reference,
+                                            imageNormMode, imageChannelOrder,
+                                            imageLayout);
+                  }),
+                  0});
+  rows.push_back(
+      {llvm::formatv("fused ({0})",
+                     image_preprocess::getIsaName(image_preprocess::isa())),
+       time([&] { loadImagesFused(filenames, fused); }),
+       getMaxAbsDifference(fused, reference)});
+  std::vector<DecodedImage> images(filenames.size());
+  rows.push_back({"libpng decode only", time([&] {
+                    for (size_t i = 0; i < filenames.size(); i++) {
+                      decodePng(filenames[i], images[i]);
+                    }
+                  }),
+                  -1});
+  for (auto isa : {image_preprocess::Isa::Scalar, image_preprocess::Isa::AVX2,
+                   image_preprocess::Isa::AVX512}) {
+    if (!image_preprocess::isSupported(isa)) {
+      continue;
+    }
+    rows.push_back(
+        {llvm::formatv("{0} kernel only", image_preprocess::getIsaName(isa)),
+         time([&] { preprocessDecodedImages(images, options, isa, fused); }),
+         0});
+    rows.back().diff = getMaxAbsDifference(fused, reference);
+  }
+
+  llvm::outs() << llvm::formatv("Preprocessing {0} images of {1}x{2}, median "
+                                "of {3} runs:\n",
+                                filenames.size(), images[0].width,
+                                images[0].height, runs);
+  llvm::outs() << llvm::formatv("{0,-24} {1,10} {2,8} {3,12}\n", "path",
+                                "ms/image", "speedup", "max abs diff");
+  const double base = rows[0].time.percentile(50);
+  for (const auto &row : rows) {
+    const double ns = row.time.percentile(50);
+    llvm::outs() << llvm::formatv(
+        "{0,-24} {1,10:f4} {2,7:f2}x {3,12}\n", row.path,
+        LH::toMs(uint64_t(ns / filenames.size())), ns ? base / ns : 0.0,
+        row.diff < 0 ? std::string("-") : llvm::formatv("{0:e2}", row.diff));
+  }
+  return 0;
+}
+
+llvm::cl::OptionCategory int8CompareCat("Int8 Comparison Options");
+
+llvm::cl::opt<bool> int8Compare(
+    "int8-compare",
+    llvm::cl::desc("Profile the model on a calibration subset of the inputs, "
+                   "quantize it with that profile and benchmark the FP32 and "
+                   "the quantized model side by side on all inputs, reporting "
+                   "the speedup and the top-1/top-5 agreement. With "
+                   "-model-list, every listed model is compared in turn."),
+    llvm::cl::Optional, llvm::cl::init(false), llvm::cl::cat(int8CompareCat));
+
+llvm::cl::opt<unsigned> int8CalibrationImages(
+    "int8-calibration-images",
+    llvm::cl::desc("Number of inputs, counted from the first, that "
+                   "-int8-compare profiles, rounded up to whole batches. 0 "
+                   "profiles all inputs."),
+    llvm::cl::Optional, llvm::cl::init(0), llvm::cl::cat(int8CompareCat));
+
+llvm::cl::opt<std::string> int8ProfileDir(
+    "int8-profile-dir",
+    llvm::cl::desc("Keep the quantization profile of every model compared by "
+                   "-int8-compare in this directory, named after the model "
+                   "file. By default profiles go to temporary files that are "
+                   "removed after use."),
+    llvm::cl::value_desc("dir"), llvm::cl::Optional,
+    llvm::cl::cat(int8CompareCat));
+
+llvm::cl::opt<std::string> int8CompareResultsPath(
+    "int8-compare-results",
+    llvm::cl::desc("Write the FP32 and quantized throughput and the agreement "
+                   "of every model compared by -int8-compare as CSV to this "
+                   "file."),
+    llvm::cl::value_desc("file.csv"), llvm::cl::Optional,
+    llvm::cl::cat(int8CompareCat));
+
+/// Appends the indices of the (up to) five highest scores of each of the
+/// first \p numScored images of the output batch \p output of \p batchSize
+/// images to \p top, best first. \returns false if \p output does not hold
+/// float scores.
+bool appendTopFive(const Tensor &output, size_t batchSize, size_t numScored,
+                   std::vector<std::vector<size_t>> &top) {
+  Tensor converted;
+  const Tensor *scores = &output;
+  if (output.getElementType() == ElemKind::Float16Ty) {
+    convertTensorToFloat(output, converted);
+    scores = &converted;
+  } else if (output.getElementType() != ElemKind::FloatTy) {
+    return false;
+  }
+  const float *data = reinterpret_cast<const float *>(scores->getUnsafePtr());
+  const size_t classes = scores->size() / batchSize;
+  const size_t k = std::min<size_t>(5, classes);
+  std::vector<size_t> order(classes);
+  for (size_t n = 0; n < numScored; n++) {
+    const float *image = data + n * classes;
+    std::iota(order.begin(), order.end(), 0);
+    std::partial_sort(
+        order.begin(), order.begin() + k, order.end(),
+        [&](size_t a, size_t b) { return image[a] > image[b]; });
+    top.emplace_back(order.begin(), order.begin() + k);
+  }
+  return true;
+}
+
+/// FP32 and quantized results of one model compared by -int8-compare.
+struct Int8Comparison {
+  std::string model;
+  uint64_t profileNs;
+  LatencyHistogram fp32;
+  LatencyHistogram int8;
+  /// Number of images whose top classes were compared; 0 if the model does
+  /// not have a single float score output.
+  size_t images;
+  /// Images whose FP32 top-1 class is the quantized top-1 class.
+  size_t top1Agree;
+  /// Images whose FP32 top-1 class is among the quantized top-5 classes.
+  size_t top5Agree;
+};
+
+/// Compares the FP32 and the quantized version of each model of \p paths,
+/// or of the model given by -m if \p paths is empty, on the \p inputs
+/// images in batches of -minibatch images or all inputs. If the batch size
+/// does not divide the number of images, the last batch is padded with
+/// images from the start, which are left out of the top class comparison.
+/// For each model, a
+/// Loader set up by \p addExtensions first profiles the first
+/// -int8-calibration-images inputs as -dump-profile does. Two more Loaders
+/// then compile the FP32 model and the model quantized with that profile as
+/// -load-profile does, following -quantization-schema and
+/// -quantization-precision. Each of them runs every batch once to collect the
+/// top classes of every image, and then runs the last batch -latency-warmup
+/// untimed and -latency-runs timed times. Only one Loader exists at a time.
+/// \returns the number of errors.
+int runInt8Comparison(const Tensor &inputs,
+                      const std::function<void(Loader &)> &addExtensions,
+                      llvm::ArrayRef<std::string> paths) {
+  const size_t numImages = inputs.dims()[0];
+  const size_t batchSize = miniBatch ? size_t(miniBatch) : numImages;
+  if (!numImages || batchSize > numImages) {
+    llvm::errs() << "-int8-compare needs at least one batch of " << batchSize
+                 << " images, got " << numImages << "\n";
+    return 1;
+  }
+  const size_t numBatches = (numImages + batchSize - 1) / batchSize;
+  const size_t paddedImages = numBatches * batchSize - numImages;
+  const size_t calibrationBatches =
+      int8CalibrationImages
+          ? std::min(numBatches,
+                     (int8CalibrationImages + batchSize - 1) / batchSize)
+          : numBatches;
+  const size_t calibrationImages =
+      std::min(calibrationBatches * batchSize, numImages);
+  ShapeVector batchDims(inputs.dims().begin(), inputs.dims().end());
+  batchDims[0] = batchSize;
+  Tensor batch(ElemKind::FloatTy, batchDims);
+  const size_t batchBytes = batch.getSizeInBytes();
+  const size_t imageBytes = batchBytes / batchSize;
+  if (paddedImages) {
+    llvm::outs() << llvm::formatv(
+        "{0} images do not fill {1} batches of {2}; the last batch is padded "
+        "with the first {3} images, which are not compared.\n",
+        numImages, numBatches, batchSize, paddedImages);
+  }
+
+  // Compiles the current model with a fresh Loader and runs each of the
+  // first \p runBatches batches once. When \p top is given, the top classes
+  // of every image are appended to it, or it is cleared if the model has no
+  // single score output. A profiling Loader then serializes its profile;
+  // otherwise the last batch is benchmarked into \p latency, reported as
+  // \p label with -latency-adaptive.
+  auto runModel = [&](size_t runBatches, LatencyHistogram *latency,
+                      std::vector<std::vector<size_t>> *top,
+                      llvm::StringRef label) {
+    Loader loader;
+    addExtensions(loader);
+    BatchBenchmark benchmark(loader, batch.getType());
+    Placeholder *outputPH = benchmark.getSingleOutput();
+    bool scored = top && outputPH;
+    for (size_t b = 0; b < runBatches; b++) {
+      const size_t numReal = std::min(batchSize, numImages - b * batchSize);
+      std::memcpy(batch.getUnsafePtr(), inputs.getUnsafePtr() + b * batchBytes,
+                  numReal * imageBytes);
+      std::memcpy(batch.getUnsafePtr() + numReal * imageBytes,
+                  inputs.getUnsafePtr(), (batchSize - numReal) * imageBytes);
+      benchmark.setInput(batch);
+      benchmark.run();
+      if (scored) {
+        scored = appendTopFive(*benchmark.bindings().get(outputPH), batchSize,
+                               numReal, *top);
+      }
+    }
+    if (top && !scored) {
+      top->clear();
+    }
+    if (!latency) {
+      loader.generateAndSerializeProfilingInfos(benchmark.bindings());
+      return;
+    }
+    benchmark.time(*latency, label);
+  };
+
+  const std::vector<std::string> givenModelPaths = modelPathOpt;
+  std::vector<std::string> models(paths.begin(), paths.end());
+  if (models.empty()) {
+    models.push_back(llvm::join(givenModelPaths, ","));
+  }
+  std::vector<Int8Comparison> results;
+  for (const auto &model : models) {
+    // The Loader takes the model to import from the -m option.
+    ScopedOptionValue<std::vector<std::string>> modelPath(
+        modelPathOpt, paths.empty() ? givenModelPaths
+                                    : std::vector<std::string>{model});
+    llvm::SmallString<128> profilePath;
+    if (int8ProfileDir.empty()) {
+      if (auto EC = llvm::sys::fs::createTemporaryFile("int8-profile", "yaml",
+                                                       profilePath)) {
+        llvm::errs() << "Failed to create a profile file: " << EC.message()
+                     << "\n";
+        return 1;
+      }
+    } else {
+      profilePath = int8ProfileDir;
+      llvm::sys::path::append(profilePath,
+                              llvm::sys::path::stem(modelPathOpt.front()) +
+                                  ".yaml");
+    }
+
+    Int8Comparison result = {model, 0, LatencyHistogram(),
+                             LatencyHistogram(), 0, 0, 0};
+    const auto profileStart = LatencyClock::now();
+    {
+      ScopedOptionValue<std::string, llvm::cl::opt<std::string>> dumpProfile(
+          dumpProfileFileOpt, std::string(profilePath.str()));
+      runModel(calibrationBatches, nullptr, nullptr, "");
+    }
+    result.profileNs = latencyNs(profileStart, LatencyClock::now());
+
+    std::vector<std::vector<size_t>> fp32Top, int8Top;
+    runModel(numBatches, &result.fp32, &fp32Top, "  FP32");
+    {
+      ScopedOptionValue<std::string, llvm::cl::opt<std::string>> loadProfile(
+          loadProfileFileOpt, std::string(profilePath.str()));
+      runModel(numBatches, &result.int8, &int8Top, "  Int8");
+    }
+    if (int8ProfileDir.empty()) {
+      llvm::sys::fs::remove(profilePath);
+    }
+
+    if (!fp32Top.empty() && fp32Top.size() == int8Top.size()) {
+      result.images = fp32Top.size();
+      for (size_t i = 0; i < result.images; i++) {
+        const size_t best = fp32Top[i].front();
+        result.top1Agree += int8Top[i].front() == best;
+        result.top5Agree += std::find(int8Top[i].begin(), int8Top[i].end(),
+                                      best) != int8Top[i].end();
+      }
+    }
+
+    const double fp32Throughput =
+        result.fp32.mean() ? batchSize * 1e9 / result.fp32.mean() : 0.0;
+    const double int8Throughput =
+        result.int8.mean() ? batchSize * 1e9 / result.int8.mean() : 0.0;
+    llvm::outs() << llvm::formatv(
+        "Model {0}: profiled {1} of {2} batches in {3:f3} s\n", model,
+        calibrationBatches, numBatches, result.profileNs / 1e9);
+    result.fp32.printSummary(llvm::outs(), "  FP32 inference");
+    result.int8.printSummary(llvm::outs(), "  Int8 inference");
+    llvm::outs() << llvm::formatv(
+        "  FP32 {0:f2} images/s, int8 {1:f2} images/s, speedup {2:f2}x\n",
+        fp32Throughput, int8Throughput,
+        fp32Throughput ? int8Throughput / fp32Throughput : 0.0);
+    if (result.images) {
+      llvm::outs() << llvm::formatv(
+          "  Top-1 agreement {0:f2}%, top-5 agreement {1:f2}% over {2} "
+          "images\n",
+          100.0 * result.top1Agree / result.images,
+          100.0 * result.top5Agree / result.images, result.images);
+    } else {
+      llvm::outs() << "  Top-k agreement not computed: the model does not "
+                      "have a single float score output.\n";
+    }
+    results.push_back(std::move(result));
+  }
+
+  if (int8CompareResultsPath.empty()) {
+    return 0;
+  }
+  std::error_code EC;
+  llvm::raw_fd_ostream os(int8CompareResultsPath, EC);
+  if (EC) {
+    llvm::errs() << "Failed to open " << int8CompareResultsPath << ": "
+                 << EC.message() << "\n";
+    return 1;
+  }
+  os << "model,batch_size,calibration_images,profile_ms,fp32_mean_ms,"
+        "int8_mean_ms,fp32_images_per_second,int8_images_per_second,speedup,"
+        "images,top1_agreement,top5_agreement\n";
+  for (const auto &result : results) {
+    const double fp32Throughput =
+        result.fp32.mean() ? batchSize * 1e9 / result.fp32.mean() : 0.0;
+    const double int8Throughput =
+        result.int8.mean() ? batchSize * 1e9 / result.int8.mean() : 0.0;
+    os << result.model << ","
+       << llvm::formatv("{0},{1},{2:f3},{3:f4},{4:f4},{5:f2},{6:f2},{7:f4},"
+                        "{8},",
+                        batchSize, calibrationImages,
+                        LatencyHistogram::toMs(result.profileNs),
+                        result.fp32.mean() / 1e6, result.int8.mean() / 1e6,
+                        fp32Throughput, int8Throughput,
+                        fp32Throughput ? int8Throughput / fp32Throughput : 0.0,
+                        result.images);
+    // The agreement columns stay empty for models without a score output.
+    if (result.images) {
+      os << llvm::formatv("{0:f4},{1:f4}",
+                          double(result.top1Agree) / result.images,
+                          double(result.top5Agree) / result.images);
+    } else {
+      os << ",";
+    }
+    os << "\n";
+  }
+  return 0;
+}
+
+llvm::cl::OptionCategory compileCacheCat("Compile Cache Options");
+
+llvm::cl::opt<std::string> compileCacheDir(
+    "compile-cache-dir",
+    llvm::cl::desc("Keep compiled functions as bundles in this directory. A "
+                   "warm start runs the cached bundle instead of importing, "
+                   "optimizing and compiling the model. Requires a backend "
+                   "that can emit bundles, such as CPU."),
+    llvm::cl::value_desc("dir"), llvm::cl::Optional,
+    llvm::cl::cat(compileCacheCat));
+
+llvm::cl::opt<std::string> compileCacheCC(
+    "compile-cache-cc",
+    llvm::cl::desc("C compiler that links the bundles of the compile cache "
+                   "into shared objects. Defaults to $CC, then cc. The cache "
+                   "is disabled if it cannot be found."),
+    llvm::cl::value_desc("program"), llvm::cl::Optional,
+    llvm::cl::cat(compileCacheCat));
+
+/// Command line of this process, kept to rerun it when populating the
+/// compile cache.
+std::vector<std::string> commandLineArgs;
+
+/// \returns the registered option \p name, or nullptr.
+llvm::cl::Option *findOption(llvm::StringRef name) {
+  auto &options = llvm::cl::getRegisteredOptions();
+  auto it = options.find(name);
+  return it == options.end() ? nullptr : it->getValue();
+}
+
+/// \returns whether the upstream option \p name only affects how inputs are
+/// listed and inferences are run or reported, not the compiled function.
+/// Such options stay on the command line that emits bundles, since that run
+/// still loads the inputs, but are left out of the cache key.
+bool isRuntimeOnlyOption(llvm::StringRef name) {
+  static const char *const names[] = {
+      "minibatch-threads", "num-devices", "pool-size", "warmup",
+      "excluded-first-warmup-runs", "time", "iterations",
+      "repeat-single-batch-count", "preload-all-images",
+      "run-all-inputs-on-all-devices", "topk", "expected-labels",
+      "label-offset", "input-image-list-file", "input-image-dir",
+      "input-tensor-list-file"};
+  return std::find(std::begin(names), std::end(names), name) !=
+         std::end(names);
+}
+
+/// \returns whether \p opt only affects how the executor runs and measures
+/// the network, as opposed to how the network is compiled.
+bool isExecutorOption(const llvm::cl::Option &opt) {
+  for (const auto *cat : opt.Categories) {
+    if (cat == &latencyCat || cat == &workerCat || cat == &inputCat ||
+        cat == &traceCat || cat == &openLoopCat || cat == &dynamicBatchCat ||
+        cat == &compileCacheCat) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Creates the compile cache in compileCacheDir. Executor options are left
+/// out of the cache key and of the command line rerun to emit bundles, as
+/// are the bundle options that rerun sets itself. Runtime-only upstream
+/// options are only left out of the key. \returns nullptr if the cache
+/// cannot be used.
+std::unique_ptr<CompileCache> createCompileCache() {
+  // Bundles are linked after the measurements; make sure that can succeed
+  // before relying on the cache.
+  std::string compilerName = compileCacheCC;
+  if (compilerName.empty()) {
+    const char *envCC = std::getenv("CC");
+    compilerName = envCC && *envCC ? envCC : "cc";
+  }
+  auto compiler = llvm::sys::findProgramByName(compilerName);
+  if (!compiler) {
+    llvm::outs() << "Compile cache disabled: C compiler '" << compilerName
+                 << "' not found, set " << compileCacheCC.ArgStr
+                 << " or CC.\n";
+    return nullptr;
+  }
+
+  std::vector<std::string> keyArgs;
+  std::vector<std::string> rerunArgs = {llvm::sys::fs::getMainExecutable(
+      commandLineArgs[0].c_str(), reinterpret_cast<void *>(&findOption))};
+  for (size_t i = 1; i < commandLineArgs.size(); i++) {
+    llvm::StringRef arg = commandLineArgs[i];
+    if (!arg.startswith("-") || arg == "-") {
+      // An input, which does not influence compilation beyond the input
+      // type that is part of the key anyway.
+      rerunArgs.push_back(arg.str());
+      continue;
+    }
+    llvm::StringRef name = arg.ltrim('-').split('=').first;
+    llvm::cl::Option *opt = findOption(name);
+    const bool separateValue =
+        !arg.contains('=') && opt &&
+        opt->getValueExpectedFlag() == llvm::cl::ValueRequired &&
+        i + 1 < commandLineArgs.size();
+    const bool dropped = (opt && isExecutorOption(*opt)) ||
+                         name == "emit-bundle" || name == "bundle-api" ||
+                         name == "relocation-model" || name == "network-name";
+    const bool keyed = !dropped && !isRuntimeOnlyOption(name);
+    for (size_t j = i, e = separateValue ? i + 1 : i; j <= e; j++) {
+      if (keyed) {
+        keyArgs.push_back(commandLineArgs[j]);
+      }
+      if (!dropped) {
+        rerunArgs.push_back(commandLineArgs[j]);
+      }
+    }
+    i += separateValue;
+  }
+  auto cache = glow::make_unique<CompileCache>(
+      compileCacheDir, keyArgs, Loader::getModelOptPaths(),
+      std::move(rerunArgs), *compiler);
+  return cache->enabled() ? std::move(cache) : nullptr;
+}
+
 class PostProcessExecutor : public PostProcessOutputDataExtension {
 public:
   /// Iterates over registered extensions for processing and printing results
@@ -133,6 +2539,9 @@ void PreProcessInputExecutor::registerInputDataPreProcessingExtension(
 
 Executor::Executor(std::string appName, int argc, char **argv) {
   appName_ = appName;
+  commandLineArgs.assign(argv, argv + argc);
+  startupPhases.start();
+  const auto parseStart = LatencyClock::now();
   // Verify/initialize command line parameters, and then loader initializes
   // the ExecutionEngine and Function.
   parseCommandLine(argc, argv);
@@ -144,6 +2553,8 @@ Executor::Executor(std::string appName, int argc, char **argv) {
            "using -input-image-list-file option.";
     parseInputList(inputImageListFile);
   }
+  startupPhases.record(StartupPhases::CommandLineParsing,
+                       latencyNs(parseStart, LatencyClock::now()));
 }
 
 /// Registers a Loader Extension that will be invoked after model is loaded.
@@ -209,9 +2620,11 @@ int Executor::executeNetwork() {
   CHECK(!(streamInputFilenamesMode && emittingBundle()))
       << "Cannot emit a bundle and also stream inputs.";
 
-  // If tracing is enabled, create a TraceContext to merge each runs events
-  // into.
-  if (!tracePath.empty()) {
+  // If tracing or the operator profile is enabled, create a TraceContext to
+  // merge each runs events into.
+  const bool profileOperators =
+      operatorProfile || !operatorProfileCSVPath.empty();
+  if (!tracePath.empty() || profileOperators) {
     traceContext = glow::make_unique<TraceContext>(TraceLevel::STANDARD);
   }
 
@@ -243,7 +2656,29 @@ int Executor::executeNetwork() {
   // Print out the inferred image classification.
   // llvm::outs() << "Model: " << Loader::getModelOptPath() << "\n";
   std::mutex ioMu;
-  int numErrors = 0;
+  std::atomic<int> numErrors{0};
+  LatencyHistogram totalLatencyHist;
+
+  // Open-loop mode: every worker binds its first minibatch and then serves
+  // requests from openLoopQueue, recording the time from arrival to dispatch
+  // and from arrival to completion.
+  const bool openLoopMode = openLoopQPS > 0;
+  CHECK(!openLoopMode || (!iterationsOpt && !streamInputFilenamesMode &&
+                          !emittingBundle() && !profilingGraph()))
+      << "open-loop-qps cannot be combined with benchmark iterations, stream "
+         "input, bundle emission or profiling.";
+  OpenLoopQueue openLoopQueue;
+  LatencyHistogram openLoopQueueingHist;
+  LatencyHistogram openLoopResponseHist;
+
+  // Dynamic batching mode: a reader thread queues the requests read from
+  // stdin and the single worker runs them in batches of dynamicBatchSize.
+  const bool dynamicBatchingMode = dynamicBatchSize > 0;
+  CHECK(!dynamicBatchingMode || streamInputFilenamesMode)
+      << "dynamic-batch-size requires stream input mode ('-' as input).";
+  CHECK(!dynamicBatchingMode || !iterationsOpt)
+      << "dynamic-batch-size cannot be combined with benchmark iterations.";
+  LatencyHistogram dynamicBatchResponseHist;
 
   if (runAllInputsOnAllDevices) {
     if (numDevices != miniBatchThreads) {
@@ -255,30 +2690,311 @@ int Executor::executeNetwork() {
     }
   }
 
+  std::unique_ptr<InputTensorCache> inputCache;
+  if (!inputCacheDir.empty() && inputTensorListFile.empty()) {
+    inputCache = glow::make_unique<InputTensorCache>(
+        inputCacheDir, getImagePreprocessingKey(commandLineArgs));
+    if (!inputCache->enabled()) {
+      inputCache.reset();
+    }
+  }
+
+  // A batch size sweep compiles the model for batch sizes of its own, so it
+  // takes over the run. Its inputs are preloaded like -preload-all-images.
+  const bool batchSweepMode = !batchSweepSizes.empty();
+  if (batchSweepMode &&
+      (streamInputFilenamesMode || miniBatchMode || iterationsOpt ||
+       dynamicBatchingMode || openLoopMode || emittingBundle() ||
+       profilingGraph() || !compileCacheDir.empty())) {
+    llvm::errs() << "-batch-sweep sets the batch size itself and cannot be "
+                    "combined with stream input, -minibatch, -iterations, "
+                    "-dynamic-batch-size, -open-loop-qps, bundle emission, "
+                    "profiling or -compile-cache-dir.\n";
+    return 1;
+  }
+
+  // A thread-scaling sweep runs a fixed workload per worker instead of
+  // splitting the inputs among the workers.
+  const bool threadSweepMode = threadSweepMax > 0;
+  if (threadSweepMode &&
+      (!miniBatchMode || streamInputFilenamesMode || iterationsOpt ||
+       dynamicBatchingMode || openLoopMode || emittingBundle() ||
+       profilingGraph() || !compileCacheDir.empty() || batchSweepMode ||
+       runAllInputsOnAllDevices)) {
+    llvm::errs() << "-thread-sweep needs -minibatch and cannot be combined "
+                    "with stream input, -iterations, -dynamic-batch-size, "
+                    "-open-loop-qps, bundle emission, profiling, "
+                    "-compile-cache-dir, -batch-sweep or "
+                    "-run-all-inputs-on-all-devices.\n";
+    return 1;
+  }
+
+  // A model list benchmarks other models than -m, one after the other.
+  const bool modelListMode = !modelListFile.empty();
+  std::vector<std::string> modelListPaths;
+  if (modelListMode) {
+    if (streamInputFilenamesMode || iterationsOpt || dynamicBatchingMode ||
+        openLoopMode || emittingBundle() || profilingGraph() ||
+        !compileCacheDir.empty() || batchSweepMode || threadSweepMode) {
+      llvm::errs() << "-model-list cannot be combined with stream input, "
+                      "-iterations, -dynamic-batch-size, -open-loop-qps, "
+                      "bundle emission, profiling, -compile-cache-dir, "
+                      "-batch-sweep or -thread-sweep.\n";
+      return 1;
+    }
+    if (!readModelList(modelListPaths)) {
+      return 1;
+    }
+    // Loaders created before the first model is benchmarked, such as the
+    // one preloading inputs, see the first listed model.
+    if (modelPathOpt.empty()) {
+      modelPathOpt.assign(1, modelListPaths.front());
+    }
+  }
+
+  // An int8 comparison compiles and runs every model three times itself.
+  const bool int8CompareMode = int8Compare;
+  if (int8CompareMode &&
+      (streamInputFilenamesMode || iterationsOpt || dynamicBatchingMode ||
+       openLoopMode || emittingBundle() || profilingGraph() ||
+       !loadProfileFileOpt.empty() || !compileCacheDir.empty() ||
+       batchSweepMode || threadSweepMode)) {
+    llvm::errs() << "-int8-compare cannot be combined with stream input, "
+                    "-iterations, -dynamic-batch-size, -open-loop-qps, "
+                    "bundle emission, -dump-profile, -load-profile, "
+                    "-compile-cache-dir, -batch-sweep or -thread-sweep.\n";
+    return 1;
+  }
+
+  // The preprocessing benchmark only loads the inputs and never runs a model.
+  if (preprocessBenchmarkRuns) {
+    if (streamInputFilenamesMode || !inputTensorListFile.empty()) {
+      llvm::errs() << "-preprocess-bench needs image files as inputs.\n";
+      return 1;
+    }
+    return runPreprocessBenchmark(inputImageFilenames, preprocessBenchmarkRuns);
+  }
+
+  std::vector<unsigned> cpuList;
+  if (!workerCpuList.empty() && !parseCpuList(workerCpuList, cpuList)) {
+    llvm::errs() << "Invalid -worker-cpus list: " << workerCpuList << "\n";
+    return 1;
+  }
+  if ((workerAffinity == CpuPlacement::List) == cpuList.empty()) {
+    llvm::errs() << "-worker-cpus must be given exactly when "
+                    "-worker-affinity=list.\n";
+    return 1;
+  }
+
   // If preloading then load+process all images here in preloadedInputImageData.
   Tensor preloadedInputImageData;
-  if (preloadAllImages) {
+  if (preloadAllImages || batchSweepMode || threadSweepMode ||
+      modelListMode || int8CompareMode) {
     Loader loader;
     PreProcessInputExecutor ppImageExecutor;
     addLoaderExtensions(loader);
     ppImageExecutor.registerInputDataPreProcessingExtension(
         ppInputDataExtensions_);
 
+    const unsigned numPreloadThreads =
+        preloadThreads ? unsigned(preloadThreads)
+                       : std::max(1u, std::thread::hardware_concurrency());
+    const auto preloadStart = LatencyClock::now();
     if (!inputTensorListFile.empty()) {
-      loadInputImageFromFileWithType(inputImageFilenames,
-                                     &preloadedInputImageData, imageLayout);
+      loadInputsInParallel(
+          inputImageFilenames, preloadedInputImageData, numPreloadThreads,
+          [](const std::vector<std::string> &filenames, Tensor &data) {
+            loadInputImageFromFileWithType(filenames, &data, imageLayout);
+          });
     } else {
-      loadImagesAndPreprocess(inputImageFilenames, &preloadedInputImageData,
-                              imageNormMode, imageChannelOrder, imageLayout);
+      if (!inputCache ||
+          !inputCache->lookup(inputImageFilenames, preloadedInputImageData)) {
+        loadInputsInParallel(
+            inputImageFilenames, preloadedInputImageData, numPreloadThreads,
+            [](const std::vector<std::string> &filenames, Tensor &data) {
+              preprocessImages(filenames, data);
+            });
+        if (inputCache) {
+          inputCache->store(inputImageFilenames, preloadedInputImageData);
+        }
+      }
 
       ppImageExecutor.processInputTensor(preloadedInputImageData, 0,
                                          inputImageFilenames.size(),
                                          preloadedInputImageData.dims()[0]);
     }
+    const uint64_t preloadNs = latencyNs(preloadStart, LatencyClock::now());
+    startupPhases.record(StartupPhases::InputPreload, preloadNs);
+    llvm::outs() << llvm::formatv(
+        "Preloaded {0} inputs in {1:f4} s using {2} thread(s).\n",
+        inputImageFilenames.size(), preloadNs / 1e9, numPreloadThreads);
+  }
+
+  if (batchSweepMode) {
+    return runBatchSweep(preloadedInputImageData,
+                         [&](Loader &loader) { addLoaderExtensions(loader); });
+  }
+  if (threadSweepMode) {
+    return runThreadSweep(
+        preloadedInputImageData,
+        [&](Loader &loader) { addLoaderExtensions(loader); }, cpuList);
+  }
+  if (int8CompareMode) {
+    return runInt8Comparison(
+        preloadedInputImageData,
+        [&](Loader &loader) { addLoaderExtensions(loader); }, modelListPaths);
+  }
+  if (modelListMode) {
+    return runModelList(
+        preloadedInputImageData,
+        [&](Loader &loader) { addLoaderExtensions(loader); }, modelListPaths);
+  }
+
+  // The function is compiled for the preloaded float inputs, which are
+  // converted to fp16 as a whole here; workers then bind fp16 slices of
+  // them instead of converting every minibatch.
+  const Type preloadedInputType = preloadedInputImageData.getType();
+  if (preloadAllImages && convertInAndOutToFp16) {
+    preloadedInputImageData = getFloat16Copy(preloadedInputImageData);
+  }
+
+  CHECK(!(shareCompiledFunction && runAllInputsOnAllDevices))
+      << "share-compiled-function is not compatible with "
+         "run-all-inputs-on-all-devices, which needs one Loader per device.";
+
+  // Starts device tracing on the HostManager of \p loader.
+  auto startDeviceTrace = [&](Loader &loader) {
+    loader.getHostManager()->setTraceContext(
+        glow::make_unique<TraceContext>(traceLevel));
+    Error err = loader.getHostManager()->startDeviceTrace();
+    if (err) {
+      LOG(INFO) << "Failed to start device trace.";
+      numErrors = 1;
+      return false;
+    }
+    llvm::outs() << "Device trace started.";
+    return true;
+  };
+
+  // Stops device tracing on the HostManager of \p loader and merges its events.
+  auto stopDeviceTrace = [&](Loader &loader) {
+    Error err = loader.getHostManager()->stopDeviceTrace();
+    if (err) {
+      LOG(INFO) << "Failed to stop device trace:";
+      numErrors = 1;
+      return false;
+    }
+    traceContext->merge(loader.getHostManager()->getTraceContext());
+    return true;
+  };
+
+  CHECK(inflightRequests >= 1) << "inflight-requests must be at least 1.";
+  CHECK(inflightRequests == 1 || !profilingGraph())
+      << "inflight-requests cannot be used while gathering a profile.";
+
+  // When sharing the compiled function all workers use a single Loader, so
+  // the model is imported, optimized and compiled by whichever worker reaches
+  // its first minibatch first. The Loader is created once the number of
+  // workers is known, see below.
+  std::unique_ptr<Loader> sharedLoader;
+  std::once_flag sharedCompileOnce;
+  std::pair<Placeholder *, llvm::StringMap<Placeholder *>> sharedInOutPair;
+  std::mutex sharedExtensionsMu;
+
+  // With a warm compile cache, every worker runs the cached bundle through
+  // its own CachedBundle::Instance instead of compiling the model. Only the
+  // plain blocking execution path can run bundles.
+  std::unique_ptr<CompileCache> compileCache;
+  if (!compileCacheDir.empty()) {
+    if (streamInputFilenamesMode || emittingBundle() || profilingGraph() ||
+        iterationsOpt || inflightRequests > 1 || openLoopMode ||
+        shareCompiledFunction || !tracePath.empty() || profileOperators) {
+      llvm::outs() << "Compile cache disabled: not supported with stream "
+                      "input, bundle emission, profiling, -iterations, "
+                      "-inflight-requests, -open-loop-qps, "
+                      "-share-compiled-function, -trace-path or "
+                      "-op-profile.\n";
+    } else {
+      compileCache = createCompileCache();
+    }
+  }
+
+  // Loader extensions of the shared Loader are invoked by every worker, so
+  // their calls are serialized.
+  auto lockLoaderExtensions = [&]() {
+    return sharedLoader ? std::unique_lock<std::mutex>(sharedExtensionsMu)
+                        : std::unique_lock<std::mutex>();
+  };
+
+  // With the dynamic scheduler every worker may process any minibatch; the
+  // next one to run starts at image index nextMiniBatchIndex.
+  const bool dynamicScheduling = miniBatchMode && !runAllInputsOnAllDevices &&
+                                 miniBatchScheduler ==
+                                     MiniBatchScheduler::Dynamic;
+  std::atomic<size_t> nextMiniBatchIndex{0};
+  std::vector<WorkerStats> workerStats;
+
+  // With -perf-counters, each worker counts its own thread and the threads
+  // its Loader creates, found by comparing the thread list of the process
+  // before and after creating it, and reads them around each timed
+  // inference. Loaders, and the prefetchers' helper threads, are created
+  // one at a time under threadDiscoveryMu, so no worker takes another's
+  // threads. The threads of a shared Loader serve all
+  // workers and are counted in sharedPerfCounters. perfCounters, opened on
+  // this thread, only tells whether counting works and which events count.
+  std::unique_ptr<PerfCounters> perfCounters;
+  std::unique_ptr<SharedPerfCounters> sharedPerfCounters;
+  std::vector<PerfCounterTotals> perfCounterTotals;
+  std::mutex threadDiscoveryMu;
+  if (perfCountersOpt && (inflightRequests > 1 || openLoopMode ||
+                          iterationsOpt || dynamicBatchingMode)) {
+    llvm::errs() << "-perf-counters only covers closed-loop minibatch runs "
+                    "with one request in flight, ignoring it.\n";
+  } else if (perfCountersOpt) {
+    perfCounters = glow::make_unique<PerfCounters>(
+        llvm::ArrayRef<pid_t>(PerfCounters::currentThread()));
+    if (!perfCounters->available()) {
+      llvm::errs() << "Hardware counters are not available ("
+                   << perfCounters->error()
+                   << "), continuing without -perf-counters.\n";
+      perfCounters.reset();
+    }
   }
 
+  // With several workers, each one hands its output tensors to outputQueue
+  // instead of post-processing them under ioMu. A single thread
+  // post-processes them while the workers run and keeps what that prints,
+  // which is printed by minibatch index at the end, as with one worker.
+  bool deferOutputProcessing = false;
+  PostProcessExecutor deferredPostProcessor;
+  std::unique_ptr<DeferredOutputQueue> outputQueue;
+  std::vector<llvm::StringMap<Placeholder *>> deferredOutputsPHM;
+  std::vector<std::unique_ptr<Loader>> retainedLoaders;
+
+  // When tracing, the events of every run are published by the workers into
+  // their own ring of traceCollector, whose writer thread streams them into
+  // the trace file through traceWriter; nothing is merged under a lock per
+  // run and no event is kept in memory until exit. The same thread feeds
+  // the events into operatorStats for -op-profile, with or without a trace
+  // file.
+  std::unique_ptr<TraceWriter> traceWriter;
+  std::unique_ptr<OperatorProfile> operatorStats;
+  std::unique_ptr<TraceCollector> traceCollector;
+
+  // CPU of every worker if workers are pinned. Memory is placed on the NUMA
+  // node of the thread that first touches it, so the bindings allocated by a
+  // pinned worker are local to it. With localizePreloadedInputs, each worker
+  // also copies its static range of the preloaded inputs into its own
+  // Tensor, and the last worker to do so releases the global copy.
+  std::vector<unsigned> workerPlacement;
+  bool localizePreloadedInputs = false;
+  std::atomic<size_t> localizedWorkers{0};
+  // Minibatches timed by each worker, which share -latency-time-budget-ms.
+  size_t minibatchesPerWorker = 1;
+
   // Process a set of minibatches with indices [startIndex, endIndex).
   auto processImageRange = [&](size_t startIndex, size_t endIndex, size_t TID) {
+    WorkerStats &stats = workerStats[TID];
     std::unique_ptr<ExecutionContext> exContext =
         glow::make_unique<ExecutionContext>();
     PlaceholderBindings &bindings = *exContext->getPlaceholderBindings();
@@ -286,14 +3002,64 @@ int Executor::executeNetwork() {
       exContext->setTraceContext(
           glow::make_unique<TraceContext>(TraceLevel::STANDARD));
     }
+    // Calls \p wait, which blocks until there is more work or returns false
+    // when there is none left, and counts the time as idle.
+    auto waitForWork = [&](const std::function<bool()> &wait) {
+      const auto waitStart = LatencyClock::now();
+      const bool more = wait();
+      stats.idleNs += latencyNs(waitStart, LatencyClock::now());
+      return more;
+    };
+
     // If runAllInputsOnAllDevices, then assign this thread with TID to device
     // TID. E.g. if this is TID 2 then this will be assigned to device 2.
-    Loader loader = runAllInputsOnAllDevices ? Loader(TID) : Loader();
+    std::unique_ptr<Loader> ownLoader;
+    std::unique_ptr<PerfCounters> workerPerfCounters;
+    std::vector<pid_t> perfThreads;
+    if (perfCounters) {
+      perfThreads.push_back(PerfCounters::currentThread());
+    }
+    // When prefetching, the prefetcher claims minibatches ahead of the loop
+    // and hands them over already loaded. Its helper thread is started
+    // within the thread discovery window, before the thread list is taken,
+    // so no worker counts it among its Loader's threads.
+    std::unique_ptr<InputPrefetcher> prefetcher;
+    const bool prefetching = prefetchInputs && miniBatchMode &&
+                             !preloadAllImages && !singleBatchRepeatedMode &&
+                             !iterationsOpt;
+    std::unique_lock<std::mutex> discoveryLock(threadDiscoveryMu,
+                                               std::defer_lock);
+    if (perfCounters && !sharedLoader) {
+      discoveryLock.lock();
+    }
+    if (prefetching) {
+      prefetcher = glow::make_unique<InputPrefetcher>();
+    }
+    if (!sharedLoader) {
+      const auto setupStart = LatencyClock::now();
+      std::vector<pid_t> threadsBefore;
+      if (perfCounters) {
+        threadsBefore = PerfCounters::listThreads();
+      }
+      ownLoader = runAllInputsOnAllDevices ? glow::make_unique<Loader>(TID)
+                                           : glow::make_unique<Loader>();
+      if (perfCounters) {
+        for (pid_t tid : PerfCounters::threadsSince(threadsBefore)) {
+          perfThreads.push_back(tid);
+        }
+        discoveryLock.unlock();
+      }
+      addLoaderExtensions(*ownLoader);
+      stats.setupNs += latencyNs(setupStart, LatencyClock::now());
+    }
+    if (perfCounters) {
+      workerPerfCounters = glow::make_unique<PerfCounters>(perfThreads);
+    }
+    Loader &loader = sharedLoader ? *sharedLoader : *ownLoader;
     PostProcessExecutor ppResultExecutor;
     PreProcessInputExecutor ppImageExecutor;
 
     // Registering all the extensions per thread.
-    addLoaderExtensions(loader);
     ppResultExecutor.registerPostProcessOutputExtensions(
         ppOutputDataExtensions_);
     ppImageExecutor.registerInputDataPreProcessingExtension(
@@ -308,11 +3074,51 @@ int Executor::executeNetwork() {
     std::vector<Placeholder *> outputPHV;
     llvm::StringMap<Placeholder *> PHM;
 
+    // Latency of every timed inference run issued by this worker.
+    LatencyHistogram latencyHist;
+
+    // Runs the function on exContext when it was taken from the compile
+    // cache.
+    std::unique_ptr<CachedBundle::Instance> bundleInstance;
+
+    // Whether this worker finished an inference already; the first one is
+    // reported as a startup phase.
+    bool firstInferenceDone = false;
+
+    // With more than one in-flight request, exContext plus
+    // inflightRequests - 1 further contexts are run through inflightRunner.
+    std::unique_ptr<InflightRunner> inflightRunner;
+    std::vector<std::unique_ptr<ExecutionContext>> inflightContexts;
+
     size_t miniBatchIndex = startIndex;
     Tensor inputImageData;
-    if (preloadAllImages) {
+    // Backs the fp16 copy of inputs that are converted per minibatch.
+    Tensor inputImageDataFp16;
+    // Image index of the first input held by inputImageData when preloading.
+    size_t preloadedBase = 0;
+    if (preloadAllImages && localizePreloadedInputs && endIndex > startIndex) {
+      const auto &fullDims = preloadedInputImageData.dims();
+      ShapeVector sliceShape(fullDims.begin(), fullDims.end());
+      sliceShape[0] = endIndex - startIndex;
+      inputImageData.reset(
+          Type::newShape(preloadedInputImageData.getType(), sliceShape));
+      const size_t inputBytes =
+          preloadedInputImageData.getSizeInBytes() / fullDims[0];
+      std::memcpy(inputImageData.getUnsafePtr(),
+                  preloadedInputImageData.getUnsafePtr() +
+                      startIndex * inputBytes,
+                  inputImageData.getSizeInBytes());
+      preloadedBase = startIndex;
+    } else if (preloadAllImages && !localizePreloadedInputs) {
       inputImageData = preloadedInputImageData.getUnowned();
     }
+    if (localizePreloadedInputs &&
+        localizedWorkers.fetch_add(1) + 1 == workerStats.size()) {
+      if (inputCache) {
+        inputCache->release(preloadedInputImageData);
+      }
+      preloadedInputImageData = Tensor();
+    }
     std::vector<std::string> inputImageBatchFilenames;
     if (!miniBatchMode && !streamInputFilenamesMode) {
       inputImageBatchFilenames = inputImageFilenames;
@@ -323,22 +3129,168 @@ int Executor::executeNetwork() {
                                                        miniBatch)
                         : inputImageFilenames;
     }
-    if (!tracePath.empty()) {
-      loader.getHostManager()->setTraceContext(
-          glow::make_unique<TraceContext>(traceLevel));
-      Error err = loader.getHostManager()->startDeviceTrace();
-      if (err) {
-        LOG(INFO) << "Failed to start device trace.";
-        numErrors = 1;
-        return;
+    if (!tracePath.empty() && !sharedLoader && !startDeviceTrace(loader)) {
+      return;
+    }
+
+    unsigned repeatedLoopCountRemaining = repeatSingleBatchCount;
+
+    // Loads and processes the images in \p filenames into \p data.
+    auto loadInputs = [&](const std::vector<std::string> &filenames,
+                          Tensor &data) {
+      if (!inputTensorListFile.empty()) {
+        loadInputImageFromFileWithType(filenames, &data, imageLayout);
       } else {
-        llvm::outs() << "Device trace started.";
+        // A lookup unmaps the previous hit held by data, so every worker
+        // keeps at most one mapping per input Tensor.
+        if (!inputCache || !inputCache->lookup(filenames, data)) {
+          preprocessImages(filenames, data);
+          if (inputCache) {
+            inputCache->store(filenames, data);
+          }
+        }
+
+        ppImageExecutor.processInputTensor(data, startIndex, endIndex,
+                                           data.dims()[0]);
+      }
+    };
+
+    // Claims the next minibatch of this worker, storing its filenames in
+    // \p filenames and advancing \p index to the image index past its end.
+    auto claimMiniBatch = [&](std::vector<std::string> &filenames,
+                              size_t &index) {
+      if (dynamicScheduling) {
+        index = nextMiniBatchIndex.fetch_add(miniBatch);
       }
+      return getNextMiniBatch(filenames, inputImageFilenames, index, miniBatch,
+                              endIndex);
+    };
+
+    // The prefetcher claims minibatches through its own cursor.
+    size_t prefetchIndex = startIndex;
+    if (prefetcher) {
+      prefetcher->setSource(
+          [&](std::vector<std::string> &filenames, size_t &endId) {
+            bool claimed = claimMiniBatch(filenames, prefetchIndex);
+            endId = prefetchIndex;
+            return claimed;
+          },
+          loadInputs);
     }
 
-    unsigned repeatedLoopCountRemaining = repeatSingleBatchCount;
+    // Serve stream mode requests in dynamic batches. Requests are never
+    // split, so each must fit in one batch.
+    if (dynamicBatchingMode) {
+      BatchRequestQueue requestQueue;
+      std::thread reader([&]() {
+        std::vector<std::string> filenames;
+        while (getNextImageFilenames(&filenames)) {
+          CHECK(filenames.size() <= dynamicBatchSize)
+              << "Request of " << filenames.size()
+              << " images exceeds dynamic-batch-size.";
+          requestQueue.push({filenames, LatencyClock::now()});
+        }
+        requestQueue.close();
+      });
+
+      std::vector<BatchRequest> batch;
+      Tensor paddedBatch;
+      Tensor paddedBatchFp16;
+      size_t numBatches = 0;
+      size_t numImages = 0;
+      while (waitForWork([&]() {
+        return requestQueue.popBatch(
+            batch, dynamicBatchSize,
+            std::chrono::microseconds(dynamicBatchTimeoutUs));
+      })) {
+        inputImageBatchFilenames.clear();
+        for (const auto &request : batch) {
+          inputImageBatchFilenames.insert(inputImageBatchFilenames.end(),
+                                          request.filenames.begin(),
+                                          request.filenames.end());
+        }
+        loadInputs(inputImageBatchFilenames, inputImageData);
+
+        // Copy the images into the front of the padded batch; the rest stays
+        // zero so padding rows are deterministic.
+        if (isFirstRun) {
+          isFirstRun = false;
+          ShapeVector batchShape(inputImageData.dims().begin(),
+                                 inputImageData.dims().end());
+          batchShape[0] = dynamicBatchSize;
+          paddedBatch.reset(inputImageData.getElementType(), batchShape);
+          const auto buildStart = LatencyClock::now();
+          auto inputOutputPair = buildAndRecordStartupPhases(
+              loader, bindings, paddedBatch.getType());
+          const uint64_t buildNs = latencyNs(buildStart, LatencyClock::now());
+          stats.setupNs += buildNs;
+          startupPhases.record(StartupPhases::ModelBuild, buildNs);
+          inputImagePH = inputOutputPair.first;
+          PHM = inputOutputPair.second;
+        }
+        const size_t usedBytes = inputImageData.getSizeInBytes();
+        CHECK(usedBytes <= paddedBatch.getSizeInBytes())
+            << "Input shape does not match the compiled function.";
+        std::memcpy(paddedBatch.getUnsafePtr(), inputImageData.getUnsafePtr(),
+                    usedBytes);
+        std::memset(paddedBatch.getUnsafePtr() + usedBytes, 0,
+                    paddedBatch.getSizeInBytes() - usedBytes);
+
+        Tensor inputBatch = paddedBatch.getUnowned();
+        if (convertInAndOutToFp16) {
+          convertTensorToFloat16(paddedBatch, paddedBatchFp16);
+          inputBatch = paddedBatchFp16.getUnowned();
+        }
+        // Loader extensions see every batch as a minibatch of the compiled
+        // size, indexed by the number of images served before it.
+        {
+          auto extLock = lockLoaderExtensions();
+          loader.inferInitMiniBatch(bindings, numImages, dynamicBatchSize);
+        }
+        updateInputPlaceholders(bindings, {inputImagePH}, {&inputBatch});
+        const auto batchStart = LatencyClock::now();
+        loader.runInference(exContext.get(), dynamicBatchSize);
+        if (!firstInferenceDone) {
+          firstInferenceDone = true;
+          startupPhases.recordFirstInference(
+              latencyNs(batchStart, LatencyClock::now()));
+        }
+        const auto done = LatencyClock::now();
+        if (traceCollector) {
+          traceCollector->publish(TID, *exContext->getTraceContext());
+        }
+
+        // Results of the padding rows are never looked at, since only the
+        // filenames of real requests are passed on.
+        numErrors += ppResultExecutor.processOutputs(PHM, bindings,
+                                                     inputImageBatchFilenames);
+        for (const auto &request : batch) {
+          dynamicBatchResponseHist.record(latencyNs(request.arrival, done));
+        }
+        {
+          auto extLock = lockLoaderExtensions();
+          loader.inferEndMiniBatch(bindings, numImages, dynamicBatchSize);
+        }
+        numBatches++;
+        numImages += inputImageBatchFilenames.size();
+        stats.miniBatches++;
+      }
+      reader.join();
+      if (numBatches) {
+        llvm::outs() << llvm::formatv(
+            "Dynamic batching: {0} requests in {1} batches, mean occupancy "
+            "{2:f2} of {3} images\n",
+            dynamicBatchResponseHist.count(), numBatches,
+            double(numImages) / numBatches, unsigned(dynamicBatchSize));
+      }
+    }
 
     auto loopCond = [&]() {
+      // Dynamic batching served all requests above.
+      if (dynamicBatchingMode) {
+        return false;
+      }
+
       // If in stream mode then get the next image filenames if they exist,
       // otherwise exit.
       if (streamInputFilenamesMode) {
@@ -354,29 +3306,23 @@ int Executor::executeNetwork() {
       // If in miniBatchMode then continue if we have already preloaded all
       // images (will break inside loop once done), or otherwise get the next
       // miniBatch image filenames if they exist, otherwise exit.
+      if (prefetcher) {
+        return prefetcher->next(inputImageData, inputImageBatchFilenames,
+                                miniBatchIndex);
+      }
       if (miniBatchMode) {
-        return getNextMiniBatch(inputImageBatchFilenames, inputImageFilenames,
-                                miniBatchIndex, miniBatch, endIndex);
+        return claimMiniBatch(inputImageBatchFilenames, miniBatchIndex);
       }
 
       // At least enter once, e.g. to just dump a bundle.
       return isFirstRun;
     };
 
-    while (loopCond()) {
-      if (!preloadAllImages && (!singleBatchRepeatedMode || isFirstRun)) {
+    while (waitForWork(loopCond)) {
+      if (!preloadAllImages && !prefetcher &&
+          (!singleBatchRepeatedMode || isFirstRun)) {
         // Load and process the image data into the inputImageData Tensor.
-        if (!inputTensorListFile.empty()) {
-          loadInputImageFromFileWithType(inputImageBatchFilenames,
-                                         &inputImageData, imageLayout);
-        } else {
-          loadImagesAndPreprocess(inputImageBatchFilenames, &inputImageData,
-                                  imageNormMode, imageChannelOrder,
-                                  imageLayout);
-
-          ppImageExecutor.processInputTensor(
-              inputImageData, startIndex, endIndex, inputImageData.dims()[0]);
-        }
+        loadInputs(inputImageBatchFilenames, inputImageData);
       }
 
       // Note: At this point miniBatchIndex is the end index, so subtract
@@ -402,13 +3348,43 @@ int Executor::executeNetwork() {
         isFirstRun = false;
 
         // Build and compile the graph, and then get back the input Placeholder
-        // and output Placeholder.
+        // and output Placeholder. A shared function is compiled only once;
+        // the other workers just allocate their own backing tensors.
+        const Type compileType =
+            preloadAllImages ? Type::newShape(preloadedInputType, imageShape)
+                             : inputImageData.getType();
         std::pair<Placeholder *, llvm::StringMap<Placeholder *>>
-            inputOutputPair = buildAndCompileAndGetInAndOutPair(
-                loader, bindings,
-                preloadAllImages
-                    ? Type::newShape(inputImageData.getType(), imageShape)
-                    : inputImageData.getType());
+            inputOutputPair;
+        const auto buildStart = LatencyClock::now();
+        CachedBundle *cachedBundle =
+            compileCache ? compileCache->lookup(compileType) : nullptr;
+        if (cachedBundle) {
+          bundleInstance =
+              cachedBundle->instantiate(*loader.getModule(), inputOutputPair);
+          CHECK(bundleInstance) << "Compile cache entry "
+                                << compileCache->entryDir()
+                                << " does not match its bundle.";
+          bindings.allocate(loader.getModule()->getPlaceholders());
+        } else if (sharedLoader) {
+          std::call_once(sharedCompileOnce, [&]() {
+            sharedInOutPair =
+                buildAndRecordStartupPhases(loader, bindings, compileType);
+          });
+          bindings.allocate(loader.getModule()->getPlaceholders());
+          inputOutputPair = sharedInOutPair;
+        } else {
+          inputOutputPair =
+              buildAndRecordStartupPhases(loader, bindings, compileType);
+          if (compileCache) {
+            compileCache->recordPlaceholders(inputOutputPair.first,
+                                             inputOutputPair.second);
+          }
+        }
+        const uint64_t buildNs = latencyNs(buildStart, LatencyClock::now());
+        stats.setupNs += buildNs;
+        startupPhases.record(cachedBundle ? StartupPhases::CompileCacheLoad
+                                          : StartupPhases::ModelBuild,
+                             buildNs);
 
         // If in bundle mode, the bundle has been saved by the above call, so we
         // can safely return.
@@ -419,14 +3395,26 @@ int Executor::executeNetwork() {
 
         inputImagePH = inputOutputPair.first;
         PHM = inputOutputPair.second;
+        if (deferOutputProcessing) {
+          deferredOutputsPHM[TID] = PHM;
+        }
         for (auto phI = PHM.begin(), e = PHM.end(); phI != e; ++phI) {
           CHECK(phI->second) << "Placeholder in output map is NULL.";
           outputPHV.push_back(phI->second);
         }
       }
 
+      // A single repeated batch is converted to fp16 once, right after it
+      // was loaded, like preloaded inputs.
+      if (convertInAndOutToFp16 && singleBatchRepeatedMode &&
+          inputImageData.getElementType() != ElemKind::Float16Ty) {
+        inputImageData = getFloat16Copy(inputImageData);
+      }
+
       Tensor inputImageDataBatch = inputImageData.getUnowned(
-          imageShape, {preloadAllImages ? startMiniBatchIndex : 0, 0, 0, 0});
+          imageShape,
+          {preloadAllImages ? startMiniBatchIndex - preloadedBase : 0, 0, 0,
+           0});
 
       CHECK(inputImagePH) << "Input must be valid.";
       CHECK(!PHM.empty()) << "Output must be valid.";
@@ -435,9 +3423,12 @@ int Executor::executeNetwork() {
           << inputImagePH->dims() << " vs " << inputImageDataBatch.dims();
 
       // Convert the raw input to fp16. This must be done every time we get new
-      // image data.
-      if (convertInAndOutToFp16) {
-        inputImageDataBatch.convertToType(ElemKind::Float16Ty);
+      // image data, unless it was converted when it was loaded. The fp16
+      // buffer is reused from one minibatch to the next.
+      if (convertInAndOutToFp16 &&
+          inputImageDataBatch.getElementType() != ElemKind::Float16Ty) {
+        convertTensorToFloat16(inputImageDataBatch, inputImageDataFp16);
+        inputImageDataBatch = inputImageDataFp16.getUnowned();
       }
 
       // If we are benchmarking we are done with the while loop.
@@ -446,56 +3437,221 @@ int Executor::executeNetwork() {
       }
 
       // Minibatch inference initialization of loader extensions
-      loader.inferInitMiniBatch(bindings, startMiniBatchIndex, miniBatch);
+      {
+        auto extLock = lockLoaderExtensions();
+        loader.inferInitMiniBatch(bindings, startMiniBatchIndex, miniBatch);
+      }
 
       // About to run inference, so update the input image Placeholder's backing
       // Tensor with inputImageDataBatch.
       updateInputPlaceholders(bindings, {inputImagePH}, {&inputImageDataBatch});
 
+      // In open-loop mode the bound inputs are used to serve all requests.
+      if (openLoopMode) {
+        break;
+      }
+
       // Perform the inference execution, updating output tensors.
       auto batchSize = inputImageDataBatch.dims()[0];
       // loader.runInference(exContext.get(), batchSize);
 
-	  int warm_times = 5;
-	  for(int i = 0; i< warm_times; i++){
-		  loader.runInference(exContext.get(), batchSize);
-	  }
-	  int times = 10;
-	  struct timeval t_start, t_end;
-	  struct timeval t[times][2];
-	  gettimeofday(&t_start, NULL);
-	  for(int i = 0; i < times; i++){
-		  gettimeofday(&t[i][0], NULL);
-		  loader.runInference(exContext.get(), batchSize);
-		  gettimeofday(&t[i][1], NULL);
-	  }
-	  gettimeofday(&t_end, NULL);
-	  for(int i = 0; i < times; i ++){
-		  double inference_time;
-		  inference_time =((t[i][1].tv_sec - t[i][0].tv_sec) + (t[i][1].tv_usec - t[i][0].tv_usec) / 1000.0 / 1000.0);
-		  llvm::outs() << "-- " << i << ", iteration time(s) is " << llvm::formatv("{0:f6}\n", inference_time);
-	  }
-	  llvm::outs() << "average time(s) is "<<  llvm::formatv("{0:f6}\n", ((t_end.tv_sec - t_start.tv_sec) + (t_end.tv_usec - t_start.tv_usec) / 1000.0 / 1000.0) / times);
-	  if (traceContext) {
-        traceContext->merge(exContext->getTraceContext());
+      std::vector<uint64_t> runTimesNs;
+      if (inflightRequests > 1) {
+        if (!inflightRunner) {
+          inflightRunner = glow::make_unique<InflightRunner>(
+              *loader.getHostManager(), loader.getFunctionName());
+          for (unsigned i = 1; i < inflightRequests; i++) {
+            auto context = glow::make_unique<ExecutionContext>();
+            context->getPlaceholderBindings()->allocate(
+                loader.getModule()->getPlaceholders());
+            inflightContexts.push_back(std::move(context));
+          }
+        }
+        for (auto &context : inflightContexts) {
+          if (traceContext) {
+            context->setTraceContext(
+                glow::make_unique<TraceContext>(TraceLevel::STANDARD));
+          }
+          updateInputPlaceholders(*context->getPlaceholderBindings(),
+                                  {inputImagePH}, {&inputImageDataBatch});
+        }
+
+        // Hand exContext to the runner along with the other contexts and take
+        // it back afterwards, its bindings are used for post-processing.
+        ExecutionContext *primaryContext = exContext.get();
+        inflightContexts.push_back(std::move(exContext));
+        runTimesNs.reserve(latencyMeasuredRuns);
+        bool ok =
+            inflightRunner->run(inflightContexts, latencyWarmupRuns, nullptr);
+        const auto inflightStart = LatencyClock::now();
+        ok = ok && inflightRunner->run(inflightContexts, latencyMeasuredRuns,
+                                       &runTimesNs);
+        const double inflightTime =
+            latencyNs(inflightStart, LatencyClock::now()) / 1e9;
+        uint64_t firstRunNs;
+        LatencyClock::time_point firstRunEnd;
+        if (!firstInferenceDone &&
+            inflightRunner->getFirstRun(firstRunNs, firstRunEnd)) {
+          firstInferenceDone = true;
+          startupPhases.recordFirstInference(firstRunNs, firstRunEnd);
+        }
+        for (auto &context : inflightContexts) {
+          if (context.get() == primaryContext) {
+            std::swap(context, inflightContexts.back());
+            exContext = std::move(inflightContexts.back());
+            inflightContexts.pop_back();
+            break;
+          }
+        }
+        if (!ok) {
+          numErrors++;
+        }
+        for (auto &context : inflightContexts) {
+          if (traceCollector) {
+            traceCollector->publish(TID, *context->getTraceContext());
+          }
+        }
+        for (uint64_t ns : runTimesNs) {
+          latencyHist.record(ns);
+        }
+        std::lock_guard<std::mutex> lock(ioMu);
+        llvm::outs() << llvm::formatv(
+            "-- {0} requests in flight: {1:f2} inferences/s\n",
+            unsigned(inflightRequests), runTimesNs.size() / inflightTime);
+      } else {
+        auto infer = [&]() {
+          if (bundleInstance) {
+            CHECK(bundleInstance->run(bindings)) << "Cached bundle failed.";
+          } else {
+            loader.runInference(exContext.get(), batchSize);
+          }
+        };
+        auto runOnce = [&]() {
+          if (firstInferenceDone) {
+            infer();
+            return;
+          }
+          firstInferenceDone = true;
+          const auto start = LatencyClock::now();
+          infer();
+          startupPhases.recordFirstInference(
+              latencyNs(start, LatencyClock::now()));
+        };
+        for (unsigned i = 0; i < latencyWarmupRuns; i++) {
+          runOnce();
+        }
+        const std::string summary = timeRuns(
+            runOnce, latencyHist,
+            llvm::formatv("Minibatch {0}{1}", startMiniBatchIndex,
+                          bundleInstance ? " (bundle)" : "")
+                .str(),
+            minibatchesPerWorker, &runTimesNs, workerPerfCounters.get(),
+            &perfCounterTotals[TID], sharedPerfCounters.get());
+        if (!summary.empty()) {
+          std::lock_guard<std::mutex> lock(ioMu);
+          llvm::outs() << summary;
+        }
+      }
+      if (latencyPrintEachRun && !runTimesNs.empty()) {
+        // Runs of a cached bundle bypass the HostManager, so they are marked
+        // rather than mixed up with regular runs.
+        const char *engine = bundleInstance ? "[bundle] " : "";
+        std::lock_guard<std::mutex> lock(ioMu);
+        uint64_t totalNs = 0;
+        for (size_t i = 0, e = runTimesNs.size(); i < e; i++) {
+          totalNs += runTimesNs[i];
+          llvm::outs() << engine << "-- " << i << ", iteration time(s) is "
+                       << llvm::formatv("{0:f6}\n", runTimesNs[i] / 1e9);
+        }
+        llvm::outs() << engine << "average time(s) is "
+                     << llvm::formatv("{0:f6}\n",
+                                      totalNs / 1e9 / runTimesNs.size());
+      }
+
+      if (traceCollector) {
+        traceCollector->publish(TID, *exContext->getTraceContext());
       }
 
       // Process output of the network. Each app cand do its own post-processing
       // depending on type of the network.
-      {
+      if (!deferOutputProcessing) {
         std::lock_guard<std::mutex> lock(ioMu);
         numErrors += ppResultExecutor.processOutputs(PHM, bindings,
                                                      inputImageBatchFilenames);
       }
 
       // Minibatch inference initialization of loader extensions.
-      loader.inferEndMiniBatch(bindings, startMiniBatchIndex, miniBatch);
+      {
+        auto extLock = lockLoaderExtensions();
+        loader.inferEndMiniBatch(bindings, startMiniBatchIndex, miniBatch);
+      }
+
+      // Deferred outputs leave bindings only after the loader extensions
+      // have seen them.
+      if (deferOutputProcessing) {
+        outputQueue->push({TID, miniBatch ? startMiniBatchIndex / miniBatch : 0,
+                           inputImageBatchFilenames,
+                           outputQueue->takeOutputs(TID, bindings, outputPHV)});
+      }
+      stats.miniBatches++;
+    }
+
+    if (openLoopMode && inputImagePH) {
+      LatencyHistogram queueingHist;
+      LatencyHistogram responseHist;
+      const size_t batchSize = inputImagePH->dims()[0];
+      // Events go through the trace collector run by run, as in the
+      // closed-loop path, instead of piling up in exContext.
+      auto publishTrace = [&]() {
+        if (traceCollector) {
+          traceCollector->publish(TID, *exContext->getTraceContext());
+        }
+      };
+      // The first warmup run, or the first request without warmup runs, is
+      // the first inference of the startup phases.
+      bool isFirstInference = true;
+      auto runInference = [&]() {
+        const auto runStart = LatencyClock::now();
+        loader.runInference(exContext.get(), batchSize);
+        if (isFirstInference) {
+          isFirstInference = false;
+          const auto runEnd = LatencyClock::now();
+          startupPhases.recordFirstInference(latencyNs(runStart, runEnd),
+                                             runEnd);
+        }
+      };
+      for (unsigned i = 0; i < latencyWarmupRuns; i++) {
+        runInference();
+        publishTrace();
+      }
+      openLoopQueue.workerReady();
+      LatencyClock::time_point arrival;
+      while (waitForWork([&]() { return openLoopQueue.pop(arrival); })) {
+        queueingHist.record(latencyNs(arrival, LatencyClock::now()));
+        runInference();
+        responseHist.record(latencyNs(arrival, LatencyClock::now()));
+        publishTrace();
+        stats.miniBatches++;
+      }
+      std::lock_guard<std::mutex> lock(ioMu);
+      openLoopQueueingHist.merge(queueingHist);
+      openLoopResponseHist.merge(responseHist);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(ioMu);
+      totalLatencyHist.merge(latencyHist);
     }
 
     if (iterationsOpt) {
-      // Image tensors loaded up to be run at once for benchmark mode.
+      // Image tensors loaded up to be run at once for benchmark mode. The
+      // arena backing them is only released after runBenchmark() returns.
+      std::unique_ptr<PlaceholderArena> contextArena;
       std::vector<std::unique_ptr<ExecutionContext>> contexts =
-          setupContextPool(outputPHV, inputImagePH, inputImageData);
+          contextPoolArena
+              ? setupArenaContextPool(outputPHV, inputImagePH, inputImageData,
+                                      contextArena)
+              : setupContextPool(outputPHV, inputImagePH, inputImageData);
 
       std::string name = loader.getFunctionName();
       std::unique_ptr<llvm::Timer> restRunsTimer = nullptr;
@@ -534,16 +3690,24 @@ int Executor::executeNetwork() {
     if (profilingGraph()) {
       loader.generateAndSerializeProfilingInfos(bindings);
     }
-    if (!tracePath.empty()) {
-      Error err = loader.getHostManager()->stopDeviceTrace();
-      if (err) {
-        LOG(INFO) << "Failed to stop device trace:";
-        numErrors = 1;
-        return;
-      } else {
-        traceContext->merge(loader.getHostManager()->getTraceContext());
+    // Events of every run went through the trace collector already; this
+    // only carries over the thread names of the contexts.
+    if (traceContext) {
+      traceContext->merge(exContext->getTraceContext());
+      for (auto &context : inflightContexts) {
+        traceContext->merge(context->getTraceContext());
       }
     }
+
+    // Queued outputs refer to this worker's Placeholders, which are owned
+    // by the module of its Loader, so keep it alive until they are used.
+    if (deferOutputProcessing) {
+      retainedLoaders[TID] = std::move(ownLoader);
+    }
+
+    if (!tracePath.empty() && !sharedLoader && !stopDeviceTrace(loader)) {
+      return;
+    }
   };
 
   // We will force single-threaded execution if:
@@ -570,11 +3734,103 @@ int Executor::executeNetwork() {
 
   // llvm::outs() << "Running " << numThreads << " thread(s).\n";
   std::vector<std::thread> threads(numThreads);
+  workerStats.resize(numThreads);
+  perfCounterTotals.resize(numThreads);
+  deferOutputProcessing = numThreads > 1 && !ppOutputDataExtensions_.empty();
+  deferredOutputsPHM.resize(numThreads);
+  retainedLoaders.resize(numThreads);
+  if (traceContext) {
+    if (!tracePath.empty()) {
+      traceWriter = glow::make_unique<TraceWriter>(
+          tracePath, appName_, size_t(traceMemoryCapMB) << 20);
+      if (!traceWriter->isOpen()) {
+        return 1;
+      }
+    }
+    if (profileOperators) {
+      operatorStats = glow::make_unique<OperatorProfile>();
+    }
+    traceCollector = glow::make_unique<TraceCollector>(
+        numThreads, traceRingSize, [&](std::vector<TraceEvent> &events) {
+          if (operatorStats) {
+            operatorStats->add(events);
+          }
+          if (traceWriter) {
+            traceWriter->append(events);
+          }
+        });
+  }
+
+  if (workerAffinity != CpuPlacement::None) {
+    const CpuTopology topology = CpuTopology::detect();
+    topology.print(llvm::outs());
+    workerPlacement = topology.place(workerAffinity, numThreads, cpuList);
+    for (size_t i = 0; i < workerPlacement.size(); i++) {
+      llvm::outs() << llvm::formatv("Worker {0}: CPU {1}, NUMA node {2}\n", i,
+                                    workerPlacement[i],
+                                    topology.nodeOf(workerPlacement[i]));
+    }
+    localizePreloadedInputs = !workerPlacement.empty() && preloadAllImages &&
+                              numThreads > 1 && !runAllInputsOnAllDevices &&
+                              !dynamicScheduling;
+  }
+
+  // A HostManager runs one inference per device at a time, so the shared
+  // Loader gets a device per worker. Loader::compile() saturates the host,
+  // which places the function on every device, and the HostManager spreads
+  // the workers' concurrent requests over them.
+  if (shareCompiledFunction) {
+    if (numDevices < numThreads) {
+      llvm::outs() << "Setting " << numDevices.ArgStr << " to match the "
+                   << numThreads << " workers as required by "
+                   << shareCompiledFunction.ArgStr << ".\n";
+      numDevices.getValue() = numThreads;
+    }
+    // The HostManager's threads inherit the affinity of this thread, so they
+    // are created while it is restricted to the workers' CPUs.
+    {
+      ScopedThreadAffinity onWorkerCpus(workerPlacement);
+      const std::vector<pid_t> threadsBefore =
+          perfCounters ? PerfCounters::listThreads() : std::vector<pid_t>();
+      sharedLoader = glow::make_unique<Loader>();
+      if (perfCounters) {
+        sharedPerfCounters = glow::make_unique<SharedPerfCounters>(
+            PerfCounters::threadsSince(threadsBefore));
+      }
+    }
+    addLoaderExtensions(*sharedLoader);
+    if (!tracePath.empty() && !startDeviceTrace(*sharedLoader)) {
+      return numErrors;
+    }
+  }
+
+  if (deferOutputProcessing) {
+    deferredPostProcessor.registerPostProcessOutputExtensions(
+        ppOutputDataExtensions_);
+    outputQueue = glow::make_unique<DeferredOutputQueue>(
+        numThreads, size_t(outputQueueDepth) * numThreads,
+        [&](DeferredOutputs &outputs, std::string &printed) {
+          // Keeps the workers' timing lines out of the captured results.
+          std::lock_guard<std::mutex> lock(ioMu);
+          numErrors += captureStdout(
+              [&]() {
+                return deferredPostProcessor.processOutputs(
+                    deferredOutputsPHM[outputs.threadId], *outputs.bindings,
+                    outputs.filenames);
+              },
+              printed);
+        });
+  }
+
   const size_t miniBatchesPerThread =
       (numBatches + numThreads - 1) / numThreads;
+  minibatchesPerWorker = singleBatchRepeatedMode  ? repeatSingleBatchCount
+                         : runAllInputsOnAllDevices ? numBatches
+                                                    : miniBatchesPerThread;
+  const auto runStart = LatencyClock::now();
   for (size_t i = 0; i < numThreads; i++) {
     size_t startIndex, endIndex;
-    if (!runAllInputsOnAllDevices && numThreads > 1) {
+    if (!runAllInputsOnAllDevices && !dynamicScheduling && numThreads > 1) {
       startIndex = i * miniBatchesPerThread * miniBatch;
       endIndex = std::min((i + 1) * miniBatchesPerThread * miniBatch,
                           inputImageFilenames.size());
@@ -582,20 +3838,138 @@ int Executor::executeNetwork() {
       startIndex = 0;
       endIndex = inputImageFilenames.size();
     }
-    auto worker = [&processImageRange, startIndex, endIndex, i]() {
+    auto worker = [&processImageRange, &workerStats, &openLoopQueue,
+                   &outputQueue, &workerPlacement, startIndex, endIndex, i]() {
+      if (!workerPlacement.empty() && !pinCurrentThread(workerPlacement[i])) {
+        llvm::errs() << "Failed to pin worker " << i << " to CPU "
+                     << workerPlacement[i] << "\n";
+      }
+      workerStats[i].start = LatencyClock::now();
       processImageRange(startIndex, endIndex, i);
+      workerStats[i].end = LatencyClock::now();
+      openLoopQueue.workerExited();
+      if (outputQueue) {
+        outputQueue->workerExited();
+      }
     };
     threads.push_back(std::thread(worker));
   }
 
+  LatencyClock::time_point openLoopStart;
+  if (openLoopMode) {
+    openLoopStart = openLoopQueue.generate(numThreads, openLoopQPS,
+                                           openLoopArrivals, openLoopRequests,
+                                           openLoopSeed);
+  }
+
   for (auto &t : threads) {
     if (t.joinable()) {
       t.join();
     }
   }
+  const auto runEnd = LatencyClock::now();
+
+  if (traceCollector) {
+    traceCollector->finish();
+    llvm::outs() << "Trace: " << traceCollector->numEvents()
+                 << " events collected, " << traceCollector->numStalls()
+                 << " producer stalls on a full ring\n";
+  }
+
+  if (operatorStats) {
+    operatorStats->finish();
+    if (operatorStats->numOperators() == 0) {
+      llvm::outs() << "Operator profile: no operator events were recorded, "
+                      "run with -auto-instrument.\n";
+    } else {
+      operatorStats->print(llvm::outs(), operatorProfileTop);
+    }
+    if (!operatorProfileCSVPath.empty() &&
+        !operatorStats->dumpCSV(operatorProfileCSVPath)) {
+      numErrors++;
+    }
+  }
+
+  if (outputQueue) {
+    outputQueue->finish();
+  }
+
+  if (numThreads > 1) {
+    printWorkerStats(workerStats, runStart, runEnd);
+  }
+  if (perfCounters) {
+    printPerfCounters(llvm::outs(), *perfCounters, perfCounterTotals,
+                      sharedPerfCounters.get());
+  }
+
+  if (sharedLoader && !tracePath.empty()) {
+    stopDeviceTrace(*sharedLoader);
+  }
+
+  if (inputCache) {
+    llvm::outs() << "Input cache: " << inputCache->hits() << " hits, "
+                 << inputCache->misses() << " misses\n";
+  }
+
+  // A warm compile cache runs the cached bundle directly instead of going
+  // through the HostManager, which every output says.
+  const bool ranBundle = compileCache && compileCache->hit();
+  const char *engine = ranBundle ? "bundle" : "host_manager";
+  if (totalLatencyHist.count()) {
+    totalLatencyHist.printSummary(
+        llvm::outs(), ranBundle ? "Inference (bundle)" : "Inference");
+  }
+  if (dynamicBatchResponseHist.count()) {
+    dynamicBatchResponseHist.printSummary(llvm::outs(),
+                                          "Dynamic batch response");
+  }
+  if (openLoopResponseHist.count()) {
+    llvm::outs() << llvm::formatv(
+        "Open-loop: offered {0:f2} qps, completed {1} requests at {2:f2} "
+        "qps\n",
+        double(openLoopQPS), openLoopResponseHist.count(),
+        openLoopResponseHist.count() /
+            (latencyNs(openLoopStart, runEnd) / 1e9));
+    openLoopQueueingHist.printSummary(llvm::outs(), "Open-loop queueing");
+    openLoopResponseHist.printSummary(llvm::outs(), "Open-loop response");
+  }
+  if (!latencyJSONPath.empty() &&
+      (totalLatencyHist.count() || openLoopResponseHist.count() ||
+       dynamicBatchResponseHist.count()) &&
+      !dumpLatencyJSON(latencyJSONPath,
+                       {{"latency", &totalLatencyHist},
+                        {"open_loop_queueing", &openLoopQueueingHist},
+                        {"open_loop_response", &openLoopResponseHist},
+                        {"dynamic_batch_response", &dynamicBatchResponseHist}},
+                       numThreads, engine)) {
+    numErrors++;
+  }
+
+  if (!startupJSONPath.empty() &&
+      !startupPhases.dumpJSON(startupJSONPath, engine)) {
+    numErrors++;
+  }
+
+  // After a cold start the function is compiled once more into a bundle for
+  // the cache, which happens after all measurements.
+  if (compileCache && numErrors == 0) {
+    if (compileCache->hit()) {
+      llvm::outs() << "Compile cache: ran the cached bundle in "
+                   << compileCache->entryDir() << "\n";
+    } else if (compileCache->store()) {
+      llvm::outs() << "Compile cache: stored " << compileCache->entryDir()
+                   << "\n";
+    }
+  }
 
-  if (!tracePath.empty()) {
-    traceContext->dump(tracePath, appName_);
+  // The device events merged into traceContext when tracing stopped are
+  // written last, followed by the thread names of every context.
+  if (traceWriter) {
+    traceWriter->append(traceContext->getTraceEvents());
+    traceWriter->finish(traceContext->getThreadNames());
+    llvm::outs() << "Trace: " << traceWriter->numEvents() << " events written "
+                 << "to " << tracePath << " in " << traceWriter->numFlushes()
+                 << " chunks\n";
   }
 
   return numErrors;
@@ -0,0 +1,182 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_FLOAT16CONVERSION_H
+#define GLOW_TOOLS_LOADER_FLOAT16CONVERSION_H
+
+#include "glow/Base/Tensor.h"
+#include "glow/Support/Float16.h"
+
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GLOW_FLOAT16_CONVERSION_X86 1
+#endif
+
+namespace glow {
+
+/// Bulk conversions between float and float16 buffers. On x86 the widest
+/// conversion instructions the CPU supports are picked at run time: 16
+/// elements per instruction with AVX-512F, 8 with F16C. Both round to nearest
+/// even, like the scalar float16 conversion used otherwise and for the tail.
+namespace float16_conversion {
+
+enum class Isa { Scalar, F16C, AVX512 };
+
+/// \returns the conversion instructions available on this CPU.
+inline Isa detectIsa() {
+#ifdef GLOW_FLOAT16_CONVERSION_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return Isa::AVX512;
+  }
+  if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c")) {
+    return Isa::F16C;
+  }
+#endif
+  return Isa::Scalar;
+}
+
+inline Isa isa() {
+  static const Isa detected = detectIsa();
+  return detected;
+}
+
+#ifdef GLOW_FLOAT16_CONVERSION_X86
+/// Each function converts the largest prefix of \p n elements that fits its
+/// vector width and \returns the number of elements converted.
+__attribute__((target("avx512f"))) inline size_t
+toFloat16AVX512(const float *src, float16 *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(dst + i),
+        _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+  }
+  return i;
+}
+
+__attribute__((target("avx,f16c"))) inline size_t
+toFloat16F16C(const float *src, float16 *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i *>(dst + i),
+        _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+  }
+  return i;
+}
+
+__attribute__((target("avx512f"))) inline size_t
+toFloatAVX512(const float16 *src, float *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(dst + i,
+                     _mm512_cvtph_ps(_mm256_loadu_si256(
+                         reinterpret_cast<const __m256i *>(src + i))));
+  }
+  return i;
+}
+
+__attribute__((target("avx,f16c"))) inline size_t
+toFloatF16C(const float16 *src, float *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(
+                                  reinterpret_cast<const __m128i *>(src + i))));
+  }
+  return i;
+}
+#endif
+
+} // namespace float16_conversion
+
+/// Converts the \p n floats at \p src to float16 into \p dst.
+inline void convertFloatToFloat16(const float *src, float16 *dst, size_t n) {
+  size_t i = 0;
+#ifdef GLOW_FLOAT16_CONVERSION_X86
+  switch (float16_conversion::isa()) {
+  case float16_conversion::Isa::AVX512:
+    i = float16_conversion::toFloat16AVX512(src, dst, n);
+    break;
+  case float16_conversion::Isa::F16C:
+    i = float16_conversion::toFloat16F16C(src, dst, n);
+    break;
+  case float16_conversion::Isa::Scalar:
+    break;
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = float16(src[i]);
+  }
+}
+
+/// Converts the \p n float16 values at \p src to float into \p dst.
+inline void convertFloat16ToFloat(const float16 *src, float *dst, size_t n) {
+  size_t i = 0;
+#ifdef GLOW_FLOAT16_CONVERSION_X86
+  switch (float16_conversion::isa()) {
+  case float16_conversion::Isa::AVX512:
+    i = float16_conversion::toFloatAVX512(src, dst, n);
+    break;
+  case float16_conversion::Isa::F16C:
+    i = float16_conversion::toFloatF16C(src, dst, n);
+    break;
+  case float16_conversion::Isa::Scalar:
+    break;
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = float(src[i]);
+  }
+}
+
+/// Converts the float tensor \p src into \p dst, which becomes a Float16Ty
+/// tensor of the same shape. The buffer of \p dst is reused if it already
+/// has that type.
+inline void convertTensorToFloat16(const Tensor &src, Tensor &dst) {
+  if (dst.isUnowned() || dst.getElementType() != ElemKind::Float16Ty ||
+      dst.dims() != src.dims()) {
+    dst = Tensor(ElemKind::Float16Ty, src.dims());
+  }
+  convertFloatToFloat16(reinterpret_cast<const float *>(src.getUnsafePtr()),
+                        reinterpret_cast<float16 *>(dst.getUnsafePtr()),
+                        src.size());
+}
+
+/// \returns a Float16Ty copy of the float tensor \p src.
+inline Tensor getFloat16Copy(const Tensor &src) {
+  Tensor dst;
+  convertTensorToFloat16(src, dst);
+  return dst;
+}
+
+/// Converts the Float16Ty tensor \p src into \p dst, which becomes a float
+/// tensor of the same shape. The buffer of \p dst is reused if it already
+/// has that type.
+inline void convertTensorToFloat(const Tensor &src, Tensor &dst) {
+  if (dst.isUnowned() || dst.getElementType() != ElemKind::FloatTy ||
+      dst.dims() != src.dims()) {
+    dst = Tensor(ElemKind::FloatTy, src.dims());
+  }
+  convertFloat16ToFloat(reinterpret_cast<const float16 *>(src.getUnsafePtr()),
+                        reinterpret_cast<float *>(dst.getUnsafePtr()),
+                        src.size());
+}
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_FLOAT16CONVERSION_H
@@ -0,0 +1,289 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_IMAGEPREPROCESS_H
+#define GLOW_TOOLS_LOADER_IMAGEPREPROCESS_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <png.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GLOW_IMAGE_PREPROCESS_X86 1
+#endif
+
+namespace glow {
+
+/// Fused image preprocessing: 8-bit RGB or RGBA pixels are normalized,
+/// reordered to the requested channel order and written in NCHW or NHWC
+/// layout in a single pass. On x86 the widest kernel the CPU supports is
+/// picked at run time: AVX-512F, AVX2 with FMA, or scalar code, which also
+/// handles the pixels past the last full vector of every row.
+namespace image_preprocess {
+
+enum class Isa { Scalar, AVX2, AVX512 };
+
+inline const char *getIsaName(Isa isa) {
+  switch (isa) {
+  case Isa::AVX512:
+    return "avx512";
+  case Isa::AVX2:
+    return "avx2";
+  case Isa::Scalar:
+    break;
+  }
+  return "scalar";
+}
+
+/// \returns whether the kernel for \p isa can run on this CPU.
+inline bool isSupported(Isa isa) {
+#ifdef GLOW_IMAGE_PREPROCESS_X86
+  __builtin_cpu_init();
+  switch (isa) {
+  case Isa::AVX512:
+    return __builtin_cpu_supports("avx512f");
+  case Isa::AVX2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  case Isa::Scalar:
+    break;
+  }
+#endif
+  return isa == Isa::Scalar;
+}
+
+/// \returns the widest kernel available on this CPU.
+inline Isa isa() {
+  static const Isa detected = isSupported(Isa::AVX512) ? Isa::AVX512
+                              : isSupported(Isa::AVX2) ? Isa::AVX2
+                                                       : Isa::Scalar;
+  return detected;
+}
+
+} // namespace image_preprocess
+
+/// An image decoded into rows of 8-bit pixels of \p stride bytes each, RGB
+/// or RGBA.
+struct DecodedImage {
+  size_t width{0};
+  size_t height{0};
+  unsigned stride{0};
+  std::vector<uint8_t> pixels;
+};
+
+/// Decodes the PNG file \p filename into \p image, reusing its buffer.
+/// \returns false if the file cannot be read or is not an 8-bit RGB or RGBA
+/// image; grayscale, palette and 16-bit images are left to the generic
+/// loader, which handles them differently.
+inline bool decodePng(const std::string &filename, DecodedImage &image) {
+  FILE *fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    return false;
+  }
+  png_structp png =
+      png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  png_infop info = png ? png_create_info_struct(png) : nullptr;
+  // Declared before setjmp() so that an error longjmp() does not skip their
+  // destructors.
+  std::vector<png_bytep> rows;
+  volatile bool decoded = false;
+  if (info && !setjmp(png_jmpbuf(png))) {
+    png_init_io(png, fp);
+    png_read_info(png, info);
+    const int colorType = png_get_color_type(png, info);
+    if (png_get_bit_depth(png, info) == 8 &&
+        (colorType == PNG_COLOR_TYPE_RGB ||
+         colorType == PNG_COLOR_TYPE_RGB_ALPHA)) {
+      png_set_interlace_handling(png);
+      png_read_update_info(png, info);
+      image.width = png_get_image_width(png, info);
+      image.height = png_get_image_height(png, info);
+      image.stride = colorType == PNG_COLOR_TYPE_RGB ? 3 : 4;
+      image.pixels.resize(image.width * image.height * image.stride);
+      rows.resize(image.height);
+      for (size_t y = 0; y < image.height; y++) {
+        rows[y] = &image.pixels[y * image.width * image.stride];
+      }
+      png_read_image(png, rows.data());
+      decoded = true;
+    }
+  }
+  png_destroy_read_struct(png ? &png : nullptr, info ? &info : nullptr,
+                          nullptr);
+  fclose(fp);
+  return decoded;
+}
+
+/// Turns one decoded image of a given size into normalized floats. Every
+/// output value is v * scale + bias for the source byte v, computed with a
+/// single rounding (fused multiply-add) by every kernel, so all of them give
+/// bit-identical results.
+class ImagePreprocessor {
+public:
+  static constexpr unsigned numChannels = 3;
+
+  /// Preprocesses images of \p width x \p height pixels of \p stride bytes
+  /// (3 for RGB, 4 for RGBA, whose alpha is ignored). Values are scaled from
+  /// [0, 255] to \p range. With \p bgr the channels are written in BGR order,
+  /// and with \p nchw as planes instead of interleaved.
+  ImagePreprocessor(size_t width, size_t height, unsigned stride,
+                    std::pair<float, float> range, bool bgr, bool nchw,
+                    image_preprocess::Isa isa = image_preprocess::isa())
+      : width_(width), height_(height), stride_(stride), nchw_(nchw),
+        isa_(isa), scale_((range.second - range.first) / 255),
+        bias_(range.first) {
+    for (unsigned c = 0; c < numChannels; c++) {
+      srcChannel_[c] = bgr ? numChannels - 1 - c : c;
+    }
+    // Each vector step reads the pixelsPerStep * stride bytes of a run of
+    // pixels as stride 16-byte chunks and produces numChannels vectors of 16
+    // output values. Output value l of vector j is gathered from byte
+    // masks_[j][k][l] of chunk k; 0x80 makes the shuffle yield zero for the
+    // chunks it is not in.
+    for (unsigned j = 0; j < numChannels; j++) {
+      for (unsigned l = 0; l < pixelsPerStep; l++) {
+        const unsigned out = nchw ? l : j * pixelsPerStep + l;
+        const unsigned pixel = nchw ? l : out / numChannels;
+        const unsigned channel = nchw ? j : out % numChannels;
+        const unsigned src = pixel * stride + srcChannel_[channel];
+        for (unsigned k = 0; k < 4; k++) {
+          masks_[j][k][l] = src / 16 == k ? src % 16 : 0x80;
+        }
+      }
+    }
+  }
+
+  /// Preprocesses the pixels at \p pixels into the width * height *
+  /// numChannels floats at \p out.
+  void run(const uint8_t *pixels, float *out) const {
+    for (size_t y = 0; y < height_; y++) {
+      const uint8_t *src = pixels + y * width_ * stride_;
+      float *dst = out + (nchw_ ? y * width_ : y * width_ * numChannels);
+      size_t x = 0;
+#ifdef GLOW_IMAGE_PREPROCESS_X86
+      switch (isa_) {
+      case image_preprocess::Isa::AVX512:
+        x = rowAVX512(src, dst);
+        break;
+      case image_preprocess::Isa::AVX2:
+        x = rowAVX2(src, dst);
+        break;
+      case image_preprocess::Isa::Scalar:
+        break;
+      }
+#endif
+      for (; x < width_; x++) {
+        for (unsigned c = 0; c < numChannels; c++) {
+          const float v = src[x * stride_ + srcChannel_[c]];
+          dst[nchw_ ? c * planeSize() + x : x * numChannels + c] =
+              std::fma(v, scale_, bias_);
+        }
+      }
+    }
+  }
+
+private:
+  static constexpr unsigned pixelsPerStep = 16;
+
+  size_t planeSize() const { return width_ * height_; }
+
+  /// \returns where vector \p j of the step at pixel \p x of a row goes.
+  float *stepOutput(float *dst, size_t x, unsigned j) const {
+    return nchw_ ? dst + j * planeSize() + x
+                 : dst + x * numChannels + j * pixelsPerStep;
+  }
+
+#ifdef GLOW_IMAGE_PREPROCESS_X86
+  /// Gathers the bytes of output vector \p j from the stride_ chunks at
+  /// \p chunks.
+  __attribute__((target("ssse3"))) __m128i
+  gatherBytes(const __m128i *chunks, unsigned j) const {
+    __m128i bytes = _mm_setzero_si128();
+    for (unsigned k = 0; k < stride_; k++) {
+      const __m128i mask =
+          _mm_load_si128(reinterpret_cast<const __m128i *>(masks_[j][k]));
+      bytes = _mm_or_si128(bytes, _mm_shuffle_epi8(chunks[k], mask));
+    }
+    return bytes;
+  }
+
+  /// Each function preprocesses the largest prefix of the row at \p src that
+  /// is a whole number of steps into \p dst and \returns its pixel count.
+  __attribute__((target("avx512f"))) size_t rowAVX512(const uint8_t *src,
+                                                      float *dst) const {
+    const __m512 scale = _mm512_set1_ps(scale_);
+    const __m512 bias = _mm512_set1_ps(bias_);
+    __m128i chunks[4];
+    size_t x = 0;
+    for (; x + pixelsPerStep <= width_; x += pixelsPerStep) {
+      const uint8_t *p = src + x * stride_;
+      for (unsigned k = 0; k < stride_; k++) {
+        chunks[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p) + k);
+      }
+      for (unsigned j = 0; j < numChannels; j++) {
+        const __m512 v =
+            _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(gatherBytes(chunks, j)));
+        _mm512_storeu_ps(stepOutput(dst, x, j),
+                         _mm512_fmadd_ps(v, scale, bias));
+      }
+    }
+    return x;
+  }
+
+  __attribute__((target("avx2,fma"))) size_t rowAVX2(const uint8_t *src,
+                                                     float *dst) const {
+    const __m256 scale = _mm256_set1_ps(scale_);
+    const __m256 bias = _mm256_set1_ps(bias_);
+    __m128i chunks[4];
+    size_t x = 0;
+    for (; x + pixelsPerStep <= width_; x += pixelsPerStep) {
+      const uint8_t *p = src + x * stride_;
+      for (unsigned k = 0; k < stride_; k++) {
+        chunks[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p) + k);
+      }
+      for (unsigned j = 0; j < numChannels; j++) {
+        const __m128i bytes = gatherBytes(chunks, j);
+        const __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+        const __m256 hi = _mm256_cvtepi32_ps(
+            _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+        float *out = stepOutput(dst, x, j);
+        _mm256_storeu_ps(out, _mm256_fmadd_ps(lo, scale, bias));
+        _mm256_storeu_ps(out + 8, _mm256_fmadd_ps(hi, scale, bias));
+      }
+    }
+    return x;
+  }
+#endif
+
+  size_t width_;
+  size_t height_;
+  unsigned stride_;
+  bool nchw_;
+  image_preprocess::Isa isa_;
+  float scale_;
+  float bias_;
+  unsigned srcChannel_[numChannels];
+  alignas(16) uint8_t masks_[numChannels][4][pixelsPerStep];
+};
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_IMAGEPREPROCESS_H
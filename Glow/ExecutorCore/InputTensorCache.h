@@ -0,0 +1,259 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_INPUTTENSORCACHE_H
+#define GLOW_TOOLS_LOADER_INPUTTENSORCACHE_H
+
+#include "glow/Base/Tensor.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace glow {
+
+/// On-disk cache of preprocessed input tensors. Every entry is one flat file
+/// holding a fixed size header followed by the raw tensor payload, so a hit
+/// is served by mapping the file and wrapping the payload in an unowned
+/// Tensor without any decoding or copying. Entries are keyed by the path,
+/// modification time and size of every input file plus a caller supplied
+/// string describing the preprocessing parameters; any change to either
+/// simply produces a different entry.
+class InputTensorCache {
+public:
+  /// Creates a cache rooted at \p dir for inputs preprocessed as described by
+  /// \p paramsKey.
+  InputTensorCache(llvm::StringRef dir, llvm::StringRef paramsKey)
+      : dir_(dir.str()), paramsKey_(paramsKey.str()) {
+    if (std::error_code EC = llvm::sys::fs::create_directories(dir_)) {
+      llvm::errs() << "Input cache disabled, cannot create " << dir_ << ": "
+                   << EC.message() << "\n";
+      dir_.clear();
+    }
+  }
+
+  ~InputTensorCache() {
+    for (auto &m : mappings_) {
+      munmap(m.second.first, m.second.second);
+    }
+  }
+
+  InputTensorCache(const InputTensorCache &) = delete;
+  InputTensorCache &operator=(const InputTensorCache &) = delete;
+
+  /// If an entry for \p filenames exists, makes \p data an unowned view of
+  /// its mapped payload and \returns true. The mapping is private, so later
+  /// in-place writes to \p data never reach the file. A mapping stays alive
+  /// until the Tensor viewing it is passed to release() or to lookup() again,
+  /// or until the cache is destroyed, so a caller reusing one Tensor per
+  /// minibatch holds a single mapping at a time.
+  bool lookup(llvm::ArrayRef<std::string> filenames, Tensor &data) {
+    release(data);
+    uint64_t key;
+    if (dir_.empty() || !computeKey(filenames, key)) {
+      return false;
+    }
+    int fd = open(entryPath(key).c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= headerSize) {
+      base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                  fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+      return false;
+    }
+    const Header &header = *static_cast<const Header *>(base);
+    if (std::memcmp(header.magic, magic(), sizeof(header.magic)) ||
+        header.key != key || header.numInputs != filenames.size() ||
+        header.numDims == 0 || header.numDims > max_tensor_dimensions ||
+        headerSize + header.payloadBytes != size_t(st.st_size)) {
+      munmap(base, st.st_size);
+      return false;
+    }
+    std::vector<dim_t> dims(header.dims, header.dims + header.numDims);
+    Type ty(static_cast<ElemKind>(header.elemKind), dims);
+    char *payload = static_cast<char *>(base) + headerSize;
+    data = Tensor(payload, &ty);
+    {
+      std::lock_guard<std::mutex> lock(mappingsMu_);
+      mappings_[payload] = {base, size_t(st.st_size)};
+    }
+    hits_++;
+    return true;
+  }
+
+  /// If \p data views the payload of an entry returned by lookup(), resets
+  /// it to an empty Tensor and unmaps the entry. Other tensors are left
+  /// alone.
+  void release(Tensor &data) {
+    if (!data.isUnowned()) {
+      return;
+    }
+    std::pair<void *, size_t> mapping;
+    {
+      std::lock_guard<std::mutex> lock(mappingsMu_);
+      auto it = mappings_.find(data.getUnsafePtr());
+      if (it == mappings_.end()) {
+        return;
+      }
+      mapping = it->second;
+      mappings_.erase(it);
+    }
+    data = Tensor();
+    munmap(mapping.first, mapping.second);
+  }
+
+  /// Stores \p data as the entry for \p filenames. The entry is written to a
+  /// temporary file and renamed into place, so concurrent readers and
+  /// writers never observe a partial entry.
+  void store(llvm::ArrayRef<std::string> filenames, const Tensor &data) {
+    uint64_t key;
+    if (dir_.empty() || !computeKey(filenames, key)) {
+      return;
+    }
+    misses_++;
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, magic(), sizeof(header.magic));
+    header.key = key;
+    header.numInputs = filenames.size();
+    header.elemKind = static_cast<uint32_t>(data.getElementType());
+    header.numDims = data.dims().size();
+    for (size_t i = 0, e = data.dims().size(); i < e; i++) {
+      header.dims[i] = data.dims()[i];
+    }
+    header.payloadBytes = data.getSizeInBytes();
+
+    const std::string path = entryPath(key);
+    const std::string tmpPath = llvm::formatv(
+        "{0}.tmp.{1}.{2}", path, getpid(),
+        std::hash<std::thread::id>()(std::this_thread::get_id()));
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return;
+    }
+    char pad[headerSize] = {0};
+    std::memcpy(pad, &header, sizeof(header));
+    bool ok = writeAll(fd, pad, headerSize) &&
+              writeAll(fd, data.getUnsafePtr(), header.payloadBytes);
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+      unlink(tmpPath.c_str());
+    }
+  }
+
+  /// \returns whether the cache is usable.
+  bool enabled() const { return !dir_.empty(); }
+
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+
+private:
+  /// Identifies cache entries and the version of their layout.
+  static const char *magic() { return "GLOWTC01"; }
+
+  /// Size reserved for the header; keeps the payload 64-byte aligned within
+  /// the page aligned mapping.
+  static constexpr size_t headerSize = 128;
+
+  struct Header {
+    char magic[8];
+    uint64_t key;
+    uint64_t numInputs;
+    uint32_t elemKind;
+    uint32_t numDims;
+    uint64_t dims[max_tensor_dimensions];
+    uint64_t payloadBytes;
+  };
+  static_assert(sizeof(Header) <= headerSize, "Header does not fit");
+
+  /// 64-bit FNV-1a, stable across processes and builds.
+  static void hashBytes(uint64_t &h, const void *bytes, size_t len) {
+    const unsigned char *p = static_cast<const unsigned char *>(bytes);
+    for (size_t i = 0; i < len; i++) {
+      h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+  }
+
+  /// Computes the key of the entry for \p filenames into \p key. \returns
+  /// false if any input file cannot be stat'ed.
+  bool computeKey(llvm::ArrayRef<std::string> filenames, uint64_t &key) const {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    hashBytes(h, paramsKey_.data(), paramsKey_.size());
+    for (const auto &name : filenames) {
+      struct stat st;
+      if (stat(name.c_str(), &st) != 0) {
+        return false;
+      }
+      const int64_t stamp[3] = {int64_t(st.st_mtim.tv_sec),
+                                int64_t(st.st_mtim.tv_nsec),
+                                int64_t(st.st_size)};
+      hashBytes(h, name.data(), name.size() + 1);
+      hashBytes(h, stamp, sizeof(stamp));
+    }
+    key = h;
+    return true;
+  }
+
+  std::string entryPath(uint64_t key) const {
+    return llvm::formatv("{0}/{1:x-16}.gtc", dir_, key);
+  }
+
+  static bool writeAll(int fd, const char *buf, size_t len) {
+    while (len) {
+      ssize_t n = write(fd, buf, len);
+      if (n <= 0) {
+        return false;
+      }
+      buf += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  std::string dir_;
+  std::string paramsKey_;
+  std::mutex mappingsMu_;
+  /// Base address and length of every live mapping, by payload address.
+  std::map<const char *, std::pair<void *, size_t>> mappings_;
+  std::atomic<size_t> hits_{0};
+  std::atomic<size_t> misses_{0};
+};
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_INPUTTENSORCACHE_H
@@ -0,0 +1,182 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_LATENCYHISTOGRAM_H
+#define GLOW_TOOLS_LOADER_LATENCYHISTOGRAM_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace glow {
+
+/// Monotonic clock used for every latency measurement in the executor.
+using LatencyClock = std::chrono::steady_clock;
+
+/// \returns the nanoseconds elapsed between \p start and \p end.
+inline uint64_t latencyNs(LatencyClock::time_point start,
+                          LatencyClock::time_point end) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+      .count();
+}
+
+/// A percentile reported by LatencyHistogram::printSummary() and dumpJSON(),
+/// together with the label used for it in text and JSON output.
+struct ReportedPercentile {
+  double value;
+  const char *label;
+  const char *jsonKey;
+};
+static constexpr ReportedPercentile reportedLatencyPercentiles[] = {
+    {50.0, "p50", "p50_ns"},
+    {90.0, "p90", "p90_ns"},
+    {99.0, "p99", "p99_ns"},
+    {99.9, "p99.9", "p99_9_ns"}};
+
+/// HDR-style latency histogram with log-linear buckets. Values below
+/// 2^subBucketBits ns are counted exactly; above that every power-of-two range
+/// is split into 2^(subBucketBits - 1) linear buckets, which bounds the
+/// relative error of any reported percentile by 2^(1 - subBucketBits).
+/// Recording is O(1) and the memory footprint is fixed, so it is safe to keep
+/// one histogram per worker for arbitrarily long runs and merge at the end.
+class LatencyHistogram {
+public:
+  explicit LatencyHistogram(unsigned subBucketBits = 8)
+      : subBits_(subBucketBits), half_(uint64_t(1) << (subBucketBits - 1)),
+        full_(uint64_t(1) << subBucketBits),
+        counts_(full_ + (64 - subBucketBits) * half_, 0) {}
+
+  /// Records a single sample of \p ns nanoseconds.
+  void record(uint64_t ns) {
+    counts_[bucketIndex(ns)]++;
+    count_++;
+    sum_ += ns;
+    min_ = std::min(min_, ns);
+    max_ = std::max(max_, ns);
+  }
+
+  /// Adds all samples of \p other into this histogram. Both histograms must
+  /// have been created with the same bucket precision.
+  void merge(const LatencyHistogram &other) {
+    if (other.count_ == 0) {
+      return;
+    }
+    for (size_t i = 0, e = counts_.size(); i < e; i++) {
+      counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+    sum_ += other.sum_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+
+  /// Drops all recorded samples.
+  void reset() {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    count_ = 0;
+    sum_ = 0;
+    min_ = std::numeric_limits<uint64_t>::max();
+    max_ = 0;
+  }
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const { return count_ ? double(sum_) / count_ : 0.0; }
+
+  /// \returns the value in ns at percentile \p p (0 < p <= 100). The result is
+  /// the highest value equivalent to the bucket holding that rank, clamped to
+  /// the exact recorded maximum.
+  uint64_t percentile(double p) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    uint64_t rank = uint64_t(std::ceil(p / 100.0 * count_));
+    rank = std::max<uint64_t>(1, std::min(rank, count_));
+    uint64_t seen = 0;
+    for (size_t i = 0, e = counts_.size(); i < e; i++) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        return std::max(min_, std::min(max_, bucketHighestValue(i)));
+      }
+    }
+    return max_;
+  }
+
+  /// Prints a one line summary in milliseconds prefixed with \p label.
+  void printSummary(llvm::raw_ostream &os, llvm::StringRef label) const {
+    os << label << " latency (ms): count=" << count_;
+    os << llvm::formatv(" mean={0:f4} min={1:f4}", toMs(uint64_t(mean())),
+                        toMs(min()));
+    for (const auto &p : reportedLatencyPercentiles) {
+      os << llvm::formatv(" {0}={1:f4}", p.label, toMs(percentile(p.value)));
+    }
+    os << llvm::formatv(" max={0:f4}\n", toMs(max()));
+  }
+
+  /// Writes the summary as a JSON object (values in ns) into \p os.
+  void dumpJSON(llvm::raw_ostream &os) const {
+    os << "{\"count\": " << count_ << ", \"mean_ns\": "
+       << llvm::formatv("{0:f1}", mean()) << ", \"min_ns\": " << min();
+    for (const auto &p : reportedLatencyPercentiles) {
+      os << ", \"" << p.jsonKey << "\": " << percentile(p.value);
+    }
+    os << ", \"max_ns\": " << max() << "}";
+  }
+
+  static double toMs(uint64_t ns) { return ns / 1e6; }
+
+private:
+  size_t bucketIndex(uint64_t v) const {
+    if (v < full_) {
+      return v;
+    }
+    unsigned msb = 63 - __builtin_clzll(v);
+    unsigned shift = msb - (subBits_ - 1);
+    uint64_t sub = v >> shift;
+    return full_ + (shift - 1) * half_ + (sub - half_);
+  }
+
+  uint64_t bucketHighestValue(size_t idx) const {
+    if (idx < full_) {
+      return idx;
+    }
+    uint64_t rel = idx - full_;
+    unsigned shift = rel / half_ + 1;
+    uint64_t sub = rel % half_ + half_;
+    uint64_t low = sub << shift;
+    return low + ((uint64_t(1) << shift) - 1);
+  }
+
+  unsigned subBits_;
+  uint64_t half_;
+  uint64_t full_;
+  std::vector<uint64_t> counts_;
+  uint64_t count_{0};
+  uint64_t sum_{0};
+  uint64_t min_{std::numeric_limits<uint64_t>::max()};
+  uint64_t max_{0};
+};
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_LATENCYHISTOGRAM_H
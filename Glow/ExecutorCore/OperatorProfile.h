@@ -0,0 +1,234 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_OPERATORPROFILE_H
+#define GLOW_TOOLS_LOADER_OPERATORPROFILE_H
+
+#include "LatencyHistogram.h"
+
+#include "glow/ExecutionContext/TraceEvents.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+namespace glow {
+
+/// Per-operator statistics aggregated from the events emitted by
+/// -auto-instrument, which carry the node kind in their "kind" argument.
+/// Events are grouped by node kind and name; for every group the number of
+/// calls, the total and self time and the distribution of the call duration
+/// are kept. Self time is the duration of a call minus the operator calls
+/// nested in it, as computed offline by glow_tracing_parser.py. Only the
+/// currently open calls of every thread are kept besides the per-group
+/// statistics, so memory use does not grow with the length of the run.
+/// All times are in microseconds, the unit of TraceEvent timestamps.
+class OperatorProfile {
+public:
+  /// Adds the operator events of \p events and ignores all other events. The
+  /// events of every thread must come in the order they were logged, but may
+  /// be split across any number of calls.
+  void add(llvm::ArrayRef<TraceEvent> events) {
+    for (const auto &event : events) {
+      auto kind = event.args.find("kind");
+      if (kind == event.args.end()) {
+        continue;
+      }
+      std::vector<Frame> &stack = openCalls_[event.tid];
+      closeEndedCalls(stack, event.timestamp);
+      switch (event.type) {
+      case TraceEvent::BeginType:
+        stack.push_back({event.name, kind->second, event.timestamp,
+                         std::numeric_limits<uint64_t>::max(), 0});
+        break;
+      case TraceEvent::CompleteType:
+        stack.push_back({event.name, kind->second, event.timestamp,
+                         event.timestamp + event.duration, 0});
+        break;
+      case TraceEvent::EndType:
+        closeBegunCall(stack, event.name, event.timestamp);
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+  /// Closes the calls still open after the last event. Calls that began but
+  /// never ended are dropped.
+  void finish() {
+    for (auto &tidStack : openCalls_) {
+      std::vector<Frame> &stack = tidStack.second;
+      while (!stack.empty()) {
+        Frame frame = std::move(stack.back());
+        stack.pop_back();
+        if (frame.end != std::numeric_limits<uint64_t>::max()) {
+          account(stack, frame, frame.end);
+        }
+      }
+    }
+  }
+
+  /// \returns the number of distinct operators seen.
+  size_t numOperators() const { return ops_.size(); }
+
+  /// Prints the \p top operators with the highest self time, or all of them
+  /// if \p top is 0, as a table into \p os.
+  void print(llvm::raw_ostream &os, size_t top) const {
+    const auto rows = sortedBySelfTime();
+    uint64_t calls = 0, selfUs = 0;
+    for (const auto *row : rows) {
+      calls += row->second.calls.count();
+      selfUs += row->second.selfUs;
+    }
+    os << llvm::formatv("Operator profile: {0} calls of {1} operators, {2:f3} "
+                        "ms self time\n",
+                        calls, rows.size(), selfUs / 1e3);
+    os << llvm::formatv("{0,12} {1,7} {2,8} {3,12} {4,10} {5,10}  {6}\n",
+                        "self ms", "self %", "calls", "total ms", "mean us",
+                        "p99 us", "kind: name");
+    for (size_t i = 0, e = rows.size(); i < e && (top == 0 || i < top); i++) {
+      const Stats &stats = rows[i]->second;
+      os << llvm::formatv(
+          "{0,12:f3} {1,7:f2} {2,8} {3,12:f3} {4,10:f1} {5,10}  {6}: {7}\n",
+          stats.selfUs / 1e3, selfUs ? 100.0 * stats.selfUs / selfUs : 0.0,
+          stats.calls.count(), stats.totalUs / 1e3, stats.calls.mean(),
+          stats.calls.percentile(99), std::get<0>(rows[i]->first),
+          std::get<1>(rows[i]->first));
+    }
+  }
+
+  /// Writes every operator as a CSV row into \p path, sorted by self time.
+  /// \returns false if the file could not be written.
+  bool dumpCSV(llvm::StringRef path) const {
+    std::error_code EC;
+    llvm::raw_fd_ostream os(path, EC);
+    if (EC) {
+      llvm::errs() << "Failed to open operator profile file " << path << ": "
+                   << EC.message() << "\n";
+      return false;
+    }
+    os << "kind,name,calls,total_us,self_us,mean_us,p50_us,p99_us,max_us\n";
+    for (const auto *row : sortedBySelfTime()) {
+      const Stats &stats = row->second;
+      writeQuoted(os, std::get<0>(row->first));
+      os << ",";
+      writeQuoted(os, std::get<1>(row->first));
+      os << llvm::formatv(",{0},{1},{2},{3:f3},{4},{5},{6}\n",
+                          stats.calls.count(), stats.totalUs, stats.selfUs,
+                          stats.calls.mean(), stats.calls.percentile(50),
+                          stats.calls.percentile(99), stats.calls.max());
+    }
+    return true;
+  }
+
+private:
+  /// An operator call that has not been accounted yet. Calls logged as a
+  /// begin event have an unknown end until their end event arrives.
+  struct Frame {
+    std::string name;
+    std::string kind;
+    uint64_t start;
+    uint64_t end;
+    uint64_t childUs;
+  };
+
+  struct Stats {
+    /// Operator calls are short, so a coarser bucket precision than the one
+    /// of the inference latency keeps the histogram of every operator small.
+    LatencyHistogram calls{6};
+    uint64_t totalUs{0};
+    uint64_t selfUs{0};
+  };
+
+  using Key = std::tuple<std::string, std::string>;
+
+  /// Accounts \p frame as a call that ended at \p end and charges its
+  /// duration to the enclosing call on \p stack.
+  void account(std::vector<Frame> &stack, const Frame &frame, uint64_t end) {
+    const uint64_t duration = end > frame.start ? end - frame.start : 0;
+    Stats &stats = ops_[Key(frame.kind, frame.name)];
+    stats.calls.record(duration);
+    stats.totalUs += duration;
+    stats.selfUs += duration - std::min(duration, frame.childUs);
+    if (!stack.empty()) {
+      stack.back().childUs += duration;
+    }
+  }
+
+  /// Accounts the complete calls on top of \p stack that ended by \p now.
+  void closeEndedCalls(std::vector<Frame> &stack, uint64_t now) {
+    while (!stack.empty() && stack.back().end <= now) {
+      Frame frame = std::move(stack.back());
+      stack.pop_back();
+      account(stack, frame, frame.end);
+    }
+  }
+
+  /// Accounts the innermost open call of \p name as ending at \p end. Calls
+  /// nested in it that did not end are dropped.
+  void closeBegunCall(std::vector<Frame> &stack, llvm::StringRef name,
+                      uint64_t end) {
+    for (size_t i = stack.size(); i-- > 0;) {
+      if (stack[i].name == name &&
+          stack[i].end == std::numeric_limits<uint64_t>::max()) {
+        Frame frame = std::move(stack[i]);
+        stack.resize(i);
+        account(stack, frame, end);
+        return;
+      }
+    }
+  }
+
+  std::vector<const std::pair<const Key, Stats> *> sortedBySelfTime() const {
+    std::vector<const std::pair<const Key, Stats> *> rows;
+    for (const auto &op : ops_) {
+      rows.push_back(&op);
+    }
+    std::stable_sort(rows.begin(), rows.end(),
+                     [](const auto *a, const auto *b) {
+                       return a->second.selfUs > b->second.selfUs;
+                     });
+    return rows;
+  }
+
+  static void writeQuoted(llvm::raw_ostream &os, llvm::StringRef field) {
+    os << '"';
+    for (char c : field) {
+      if (c == '"') {
+        os << '"';
+      }
+      os << c;
+    }
+    os << '"';
+  }
+
+  std::map<Key, Stats> ops_;
+  std::map<int, std::vector<Frame>> openCalls_;
+};
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_OPERATORPROFILE_H
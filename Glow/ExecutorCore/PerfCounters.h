@@ -0,0 +1,366 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_PERFCOUNTERS_H
+#define GLOW_TOOLS_LOADER_PERFCOUNTERS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace glow {
+
+/// Hardware events counted by PerfCounters.
+enum PerfEvent : unsigned {
+  PerfCycles,
+  PerfInstructions,
+  PerfStalledCycles,
+  PerfLLCMisses,
+  PerfBranchMisses,
+  PerfDTLBMisses,
+  NumPerfEvents
+};
+
+/// Event counts, scaled up for the time an event was multiplexed out.
+struct PerfCounts {
+  uint64_t values[NumPerfEvents] = {};
+
+  PerfCounts &operator+=(const PerfCounts &other) {
+    for (unsigned i = 0; i < NumPerfEvents; i++) {
+      values[i] += other.values[i];
+    }
+    return *this;
+  }
+
+  /// \returns the counts since \p start, which was read earlier.
+  PerfCounts since(const PerfCounts &start) const {
+    PerfCounts delta;
+    for (unsigned i = 0; i < NumPerfEvents; i++) {
+      delta.values[i] =
+          values[i] > start.values[i] ? values[i] - start.values[i] : 0;
+    }
+    return delta;
+  }
+};
+
+/// Hardware performance counters of a fixed set of threads, read through
+/// perf_event_open. Glow runs inferences on the threads of its device
+/// managers rather than on the thread calling runInference(), so a worker is
+/// counted together with the threads its Loader created; listThreads() and
+/// threadsSince() find those. Each thread gets two counter groups: cycles,
+/// instructions and stalled cycles, whose ratios are exact, and the three
+/// kinds of misses. Groups are multiplexed by the kernel when the PMU has too
+/// few counters, and counts are scaled up accordingly. Only user space is
+/// counted, which perf_event_paranoid levels up to 2 allow for one's own
+/// threads. Events the CPU does not support are left out; if none can be
+/// opened, e.g. in a VM without a virtual PMU or a container that forbids
+/// perf_event_open, the counters are unavailable and read() returns zeros.
+/// The threads are fixed at construction, so read() takes no lock.
+class PerfCounters {
+public:
+  /// Opens the counters of the threads \p tids.
+  explicit PerfCounters(llvm::ArrayRef<pid_t> tids) {
+    for (pid_t tid : tids) {
+      openGroup(tid, {PerfCycles, PerfInstructions, PerfStalledCycles});
+      openGroup(tid, {PerfLLCMisses, PerfBranchMisses, PerfDTLBMisses});
+    }
+  }
+
+  ~PerfCounters() {
+    for (int fd : fds_) {
+      close(fd);
+    }
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  /// \returns the ID of the calling thread.
+  static pid_t currentThread() { return pid_t(syscall(SYS_gettid)); }
+
+  /// \returns the sorted IDs of the threads of the process.
+  static std::vector<pid_t> listThreads() {
+    std::vector<pid_t> tids;
+    if (DIR *dir = opendir("/proc/self/task")) {
+      while (dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+          tids.push_back(pid_t(atoi(entry->d_name)));
+        }
+      }
+      closedir(dir);
+    }
+    std::sort(tids.begin(), tids.end());
+    return tids;
+  }
+
+  /// \returns the threads of the process that are not in \p before, an
+  /// earlier result of listThreads().
+  static std::vector<pid_t> threadsSince(const std::vector<pid_t> &before) {
+    const std::vector<pid_t> now = listThreads();
+    std::vector<pid_t> created;
+    std::set_difference(now.begin(), now.end(), before.begin(), before.end(),
+                        std::back_inserter(created));
+    return created;
+  }
+
+  static const char *getEventName(unsigned event) {
+    static const char *names[NumPerfEvents] = {
+        "cycles",       "instructions",  "stalled-cycles",
+        "llc-misses",   "branch-misses", "dtlb-misses"};
+    return names[event];
+  }
+
+  /// \returns whether any event is counted.
+  bool available() const { return !groups_.empty(); }
+
+  /// \returns whether \p event is counted.
+  bool counts(unsigned event) const { return counted_[event]; }
+
+  /// \returns why no event could be opened, or an empty string.
+  const std::string &error() const { return error_; }
+
+  /// \returns the counts of the counted threads so far. Safe to call from
+  /// any thread.
+  PerfCounts read() const {
+    PerfCounts counts;
+    // nr, time enabled, time running and one value per event of a group.
+    uint64_t buf[3 + NumPerfEvents];
+    for (const auto &group : groups_) {
+      const ssize_t size = ::read(group.fd, buf, sizeof(buf));
+      if (size < ssize_t(3 * sizeof(uint64_t)) || buf[2] == 0) {
+        continue;
+      }
+      const double scale = double(buf[1]) / buf[2];
+      for (size_t i = 0; i < group.events.size() && i < buf[0]; i++) {
+        counts.values[group.events[i]] += uint64_t(buf[3 + i] * scale);
+      }
+    }
+    return counts;
+  }
+
+private:
+  struct Group {
+    int fd;
+    std::vector<unsigned> events;
+  };
+
+  static void getEventConfig(unsigned event, perf_event_attr &attr) {
+    const uint64_t readMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    switch (event) {
+    case PerfCycles:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case PerfInstructions:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case PerfStalledCycles:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_STALLED_CYCLES_BACKEND;
+      break;
+    case PerfLLCMisses:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case PerfBranchMisses:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+    case PerfDTLBMisses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_DTLB | readMiss;
+      break;
+    }
+  }
+
+  /// Opens the supported ones of \p events on thread \p tid as one group.
+  void openGroup(pid_t tid, llvm::ArrayRef<unsigned> events) {
+    Group group = {-1, {}};
+    int lastErrno = 0;
+    for (unsigned event : events) {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      getEventConfig(event, attr);
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                         PERF_FORMAT_TOTAL_TIME_RUNNING;
+      const int fd =
+          int(syscall(SYS_perf_event_open, &attr, tid, -1, group.fd, 0));
+      if (fd < 0) {
+        lastErrno = errno;
+        continue;
+      }
+      fds_.push_back(fd);
+      if (group.fd < 0) {
+        group.fd = fd;
+      }
+      group.events.push_back(event);
+      counted_[event] = true;
+    }
+    if (group.fd >= 0) {
+      groups_.push_back(std::move(group));
+    } else if (groups_.empty() && lastErrno) {
+      error_ = strerror(lastErrno);
+      std::ifstream paranoid("/proc/sys/kernel/perf_event_paranoid");
+      std::string level;
+      if (paranoid >> level) {
+        error_ += " (perf_event_paranoid=" + level + ")";
+      }
+    }
+  }
+
+  std::vector<Group> groups_;
+  std::vector<int> fds_;
+  bool counted_[NumPerfEvents] = {};
+  std::string error_;
+};
+
+/// Counts accumulated over the inferences of one worker.
+struct PerfCounterTotals {
+  PerfCounts counts;
+  uint64_t inferences{0};
+
+  /// Adds the counts of one inference, read before it as \p start and after
+  /// it as \p end.
+  void add(const PerfCounts &start, const PerfCounts &end) {
+    counts += end.since(start);
+    inferences++;
+  }
+};
+
+/// Counts of threads that serve all workers, such as those of a shared
+/// HostManager, accumulated while at least one worker measures. Their counts
+/// cannot be split by worker, so they are reported per inference of all
+/// workers. The lock is only taken at the start and end of a measurement,
+/// never around a timed run.
+class SharedPerfCounters {
+public:
+  /// Opens the counters of the threads \p tids.
+  explicit SharedPerfCounters(llvm::ArrayRef<pid_t> tids) : counters_(tids) {}
+
+  /// Called by a worker before the runs of a measurement.
+  void begin() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active_++ == 0) {
+      start_ = counters_.read();
+    }
+  }
+
+  /// Called by a worker after a measurement of \p inferences runs.
+  void end(uint64_t inferences) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    totals_.inferences += inferences;
+    if (--active_ == 0) {
+      totals_.counts += counters_.read().since(start_);
+    }
+  }
+
+  const PerfCounters &counters() const { return counters_; }
+
+  /// \returns the counts so far. Call once no worker measures anymore.
+  const PerfCounterTotals &totals() const { return totals_; }
+
+private:
+  PerfCounters counters_;
+  std::mutex mutex_;
+  unsigned active_{0};
+  PerfCounts start_;
+  PerfCounterTotals totals_;
+};
+
+/// Prints the per-inference counts of every worker of \p totals, and of
+/// \p shared if given, as a table into \p os. Events \p counters does not
+/// count are shown as n/a. IPC (instructions per cycle) and LLC misses per
+/// thousand instructions (MPKI) tell compute-bound from memory-bound
+/// inference: low IPC with high MPKI means the cores mostly wait on memory.
+inline void printPerfCounters(llvm::raw_ostream &os,
+                              const PerfCounters &counters,
+                              llvm::ArrayRef<PerfCounterTotals> totals,
+                              const SharedPerfCounters *shared = nullptr) {
+  if (std::none_of(totals.begin(), totals.end(),
+                   [](const PerfCounterTotals &t) { return t.inferences; })) {
+    return;
+  }
+  auto cell = [&](const PerfCounterTotals &total, unsigned event) {
+    return counters.counts(event)
+               ? llvm::formatv("{0:f0}", double(total.counts.values[event]) /
+                                             total.inferences)
+                     .str()
+               : std::string("n/a");
+  };
+  auto ratio = [&](const PerfCounterTotals &total, unsigned num,
+                   unsigned den, double factor) {
+    return counters.counts(num) && counters.counts(den) &&
+                   total.counts.values[den]
+               ? llvm::formatv("{0:f2}", factor * total.counts.values[num] /
+                                             total.counts.values[den])
+                     .str()
+               : std::string("n/a");
+  };
+  os << "Hardware counters per inference (each worker's thread and the "
+        "threads its Loader created):\n";
+  os << llvm::formatv("{0,8} {1,10} {2,14} {3,14} {4,6} {5,8}", "worker",
+                      "inferences", "cycles", "instructions", "IPC",
+                      "stalled%");
+  for (unsigned event : {PerfLLCMisses, PerfBranchMisses, PerfDTLBMisses}) {
+    os << llvm::formatv(" {0,13}", PerfCounters::getEventName(event));
+  }
+  os << llvm::formatv(" {0,8}\n", "LLC MPKI");
+  auto printRow = [&](llvm::StringRef name, const PerfCounterTotals &total) {
+    os << llvm::formatv("{0,8} {1,10} {2,14} {3,14} {4,6} {5,8}", name,
+                        total.inferences, cell(total, PerfCycles),
+                        cell(total, PerfInstructions),
+                        ratio(total, PerfInstructions, PerfCycles, 1),
+                        ratio(total, PerfStalledCycles, PerfCycles, 100));
+    for (unsigned event : {PerfLLCMisses, PerfBranchMisses, PerfDTLBMisses}) {
+      os << llvm::formatv(" {0,13}", cell(total, event));
+    }
+    os << llvm::formatv(" {0,8}\n",
+                        ratio(total, PerfLLCMisses, PerfInstructions, 1000));
+  };
+  for (size_t i = 0; i < totals.size(); i++) {
+    printRow(std::to_string(i), totals[i]);
+  }
+  if (shared && shared->totals().inferences) {
+    printRow("shared", shared->totals());
+    os << "The shared row counts the threads of the shared Loader while any "
+          "worker measured, per inference of all workers.\n";
+  }
+}
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_PERFCOUNTERS_H
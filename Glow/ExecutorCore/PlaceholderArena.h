@@ -0,0 +1,108 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_PLACEHOLDERARENA_H
+#define GLOW_TOOLS_LOADER_PLACEHOLDERARENA_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace glow {
+
+/// A single anonymous mapping carved into 64-byte aligned buffers by a bump
+/// allocator. Every page is written once when the arena is created, so no
+/// buffer handed out takes a page fault on first use; the pages are placed
+/// on the NUMA node of the creating thread. Arenas of at least one huge page
+/// are huge page aligned and advised to use transparent huge pages.
+/// Buffers are only released all at once, when the arena is destroyed.
+class PlaceholderArena {
+public:
+  static constexpr size_t bufferAlignment = 64;
+  static constexpr size_t hugePageSize = size_t(2) << 20;
+
+  /// \returns \p bytes rounded up to the alignment of buffers.
+  static size_t alignedSize(size_t bytes) {
+    return (bytes + bufferAlignment - 1) & ~(bufferAlignment - 1);
+  }
+
+  /// Maps and pre-faults an arena of at least \p capacity bytes. On failure
+  /// the arena is empty and allocate() always returns nullptr.
+  explicit PlaceholderArena(size_t capacity) {
+    if (capacity == 0) {
+      return;
+    }
+    const bool huge = capacity >= hugePageSize;
+    const size_t align = huge ? hugePageSize : size_t(sysconf(_SC_PAGESIZE));
+    capacity_ = (capacity + align - 1) & ~(align - 1);
+    // Over-map by one alignment unit so a huge page aligned range fits.
+    mappedBytes_ = capacity_ + (huge ? align : 0);
+    void *base = mmap(nullptr, mappedBytes_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      capacity_ = mappedBytes_ = 0;
+      return;
+    }
+    mapping_ = static_cast<char *>(base);
+    begin_ = reinterpret_cast<char *>(
+        (reinterpret_cast<uintptr_t>(mapping_) + align - 1) & ~(align - 1));
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+      madvise(begin_, capacity_, MADV_HUGEPAGE);
+    }
+#endif
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < capacity_; offset += pageSize) {
+      static_cast<volatile char *>(begin_)[offset] = 0;
+    }
+  }
+
+  ~PlaceholderArena() {
+    if (mapping_) {
+      munmap(mapping_, mappedBytes_);
+    }
+  }
+
+  PlaceholderArena(const PlaceholderArena &) = delete;
+  PlaceholderArena &operator=(const PlaceholderArena &) = delete;
+
+  /// \returns a 64-byte aligned buffer of \p bytes, or nullptr if the arena
+  /// is exhausted.
+  char *allocate(size_t bytes) {
+    const size_t size = alignedSize(bytes);
+    if (!begin_ || capacity_ - used_ < size) {
+      return nullptr;
+    }
+    char *buffer = begin_ + used_;
+    used_ += size;
+    return buffer;
+  }
+
+  size_t capacity() const { return capacity_; }
+  size_t used() const { return used_; }
+
+private:
+  char *mapping_{nullptr};
+  size_t mappedBytes_{0};
+  char *begin_{nullptr};
+  size_t capacity_{0};
+  size_t used_{0};
+};
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_PLACEHOLDERARENA_H
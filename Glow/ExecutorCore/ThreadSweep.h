@@ -0,0 +1,173 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_THREADSWEEP_H
+#define GLOW_TOOLS_LOADER_THREADSWEEP_H
+
+#include "LatencyHistogram.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdint>
+#include <system_error>
+#include <vector>
+
+namespace glow {
+
+/// Result of running the same per-thread workload on a number of worker
+/// threads at once.
+struct ThreadSweepPoint {
+  unsigned threads;
+  unsigned batchSize;
+  /// Wall time from the first worker starting its timed runs to the last one
+  /// finishing them.
+  uint64_t wallNs;
+  /// CPU time of the whole process over the timed runs.
+  uint64_t cpuNs;
+  /// Latency of the timed runs of every worker.
+  std::vector<LatencyHistogram> perThread;
+
+  /// \returns the latency of the timed runs of all workers.
+  LatencyHistogram total() const {
+    LatencyHistogram all;
+    for (const auto &hist : perThread) {
+      all.merge(hist);
+    }
+    return all;
+  }
+
+  double imagesPerSecond() const {
+    return wallNs ? total().count() * batchSize * 1e9 / wallNs : 0.0;
+  }
+
+  /// \returns the CPU time the process spent per worker and second of wall
+  /// time. It stays near the CPU use of a single worker as long as workers
+  /// do not wait on each other.
+  double cpuPerWorker() const {
+    return wallNs ? double(cpuNs) / wallNs / threads : 0.0;
+  }
+};
+
+/// Parallel efficiency below which scaling is reported as stopped.
+constexpr double threadSweepEfficiencyFloor = 0.8;
+
+/// Prints the scaling curve of \p points, whose first point must be the
+/// single thread baseline, as a table into \p os. Speedup and efficiency are
+/// relative to the baseline throughput. Inflation is how much longer one
+/// inference takes than with a single worker; per-thread mean latencies show
+/// whether some workers slow down more than others. The first point below
+/// threadSweepEfficiencyFloor is flagged together with what saturated.
+inline void printThreadSweep(llvm::raw_ostream &os,
+                             llvm::ArrayRef<ThreadSweepPoint> points) {
+  using LH = LatencyHistogram;
+  if (points.empty()) {
+    return;
+  }
+  const double baseThroughput = points[0].imagesPerSecond();
+  const double baseLatency = points[0].total().mean();
+  const double baseCpu = points[0].cpuPerWorker();
+  os << llvm::formatv("{0,7} {1,12} {2,8} {3,10} {4,10} {5,10} {6,9} {7,9}\n",
+                      "threads", "images/s", "speedup", "efficiency",
+                      "mean ms", "p99 ms", "inflation", "cpu/thr");
+  for (const auto &point : points) {
+    const LH total = point.total();
+    const double speedup =
+        baseThroughput ? point.imagesPerSecond() / baseThroughput : 0.0;
+    os << llvm::formatv("{0,7} {1,12:f2} {2,8:f2} {3,9:f1}% {4,10:f4} "
+                        "{5,10:f4} {6,8:f2}x {7,9:f2}\n",
+                        point.threads, point.imagesPerSecond(), speedup,
+                        100.0 * speedup / point.threads,
+                        LH::toMs(uint64_t(total.mean())),
+                        LH::toMs(total.percentile(99)),
+                        baseLatency ? total.mean() / baseLatency : 0.0,
+                        point.cpuPerWorker());
+  }
+  os << "Per-thread mean latency (ms):\n";
+  for (const auto &point : points) {
+    os << llvm::formatv("{0,7}:", point.threads);
+    for (const auto &hist : point.perThread) {
+      os << llvm::formatv(" {0:f4}", LH::toMs(uint64_t(hist.mean())));
+    }
+    os << "\n";
+  }
+  for (const auto &point : points) {
+    const double efficiency =
+        baseThroughput
+            ? point.imagesPerSecond() / baseThroughput / point.threads
+            : 0.0;
+    if (efficiency >= threadSweepEfficiencyFloor) {
+      continue;
+    }
+    // Workers that keep their CPUs busy but infer slower compete for a
+    // shared resource such as memory bandwidth or the last level cache;
+    // workers that use less CPU than alone spend the time waiting.
+    const bool waiting = point.cpuPerWorker() < 0.9 * baseCpu;
+    os << llvm::formatv("Parallel efficiency drops below {0:f0}% at {1} "
+                        "threads: {2}.\n",
+                        100 * threadSweepEfficiencyFloor, point.threads,
+                        waiting ? "workers use less CPU than alone, so they "
+                                  "wait on locks or queues"
+                                : "workers stay busy but each inference "
+                                  "takes longer, so a shared resource such "
+                                  "as memory bandwidth or cache saturates");
+    return;
+  }
+  os << llvm::formatv("Parallel efficiency stays above {0:f0}% up to {1} "
+                      "threads.\n",
+                      100 * threadSweepEfficiencyFloor,
+                      points.back().threads);
+}
+
+/// Writes every point of the sweep as a CSV row into \p path. \returns false
+/// if the file could not be written.
+inline bool dumpThreadSweepCSV(llvm::StringRef path,
+                               llvm::ArrayRef<ThreadSweepPoint> points) {
+  std::error_code EC;
+  llvm::raw_fd_ostream os(path, EC);
+  if (EC) {
+    llvm::errs() << "Failed to open " << path << ": " << EC.message() << "\n";
+    return false;
+  }
+  os << "threads,images_per_second,speedup,efficiency,mean_ns,p99_ns,"
+        "inflation,cpu_per_thread,thread_mean_ns\n";
+  const double baseThroughput =
+      points.empty() ? 0.0 : points[0].imagesPerSecond();
+  const double baseLatency = points.empty() ? 0.0 : points[0].total().mean();
+  for (const auto &point : points) {
+    const LatencyHistogram total = point.total();
+    const double speedup =
+        baseThroughput ? point.imagesPerSecond() / baseThroughput : 0.0;
+    os << llvm::formatv("{0},{1:f3},{2:f4},{3:f4},{4:f1},{5},{6:f4},{7:f4},",
+                        point.threads, point.imagesPerSecond(), speedup,
+                        speedup / point.threads, total.mean(),
+                        total.percentile(99),
+                        baseLatency ? total.mean() / baseLatency : 0.0,
+                        point.cpuPerWorker());
+    // The per-thread means go into one field, separated by spaces.
+    for (size_t i = 0; i < point.perThread.size(); i++) {
+      os << (i ? " " : "")
+         << llvm::formatv("{0:f1}", point.perThread[i].mean());
+    }
+    os << "\n";
+  }
+  return true;
+}
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_THREADSWEEP_H
@@ -0,0 +1,178 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_TRACEEVENTRING_H
+#define GLOW_TOOLS_LOADER_TRACEEVENTRING_H
+
+#include "glow/ExecutionContext/TraceEvents.h"
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace glow {
+
+/// Bounded single-producer single-consumer ring of TraceEvents. Events are
+/// move-constructed into preallocated slots and destroyed when drained, so
+/// neither side takes a lock or allocates beyond what the event's own strings
+/// need, and TraceEvent needs no default constructor.
+class TraceEventRing {
+public:
+  /// Creates a ring holding at least \p capacity events, rounded up to a
+  /// power of two.
+  explicit TraceEventRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots_.resize(size);
+    mask_ = size - 1;
+  }
+
+  /// Plain new only guarantees the alignment of the indices from C++17 on.
+  static void *operator new(size_t size) {
+    void *ptr;
+    if (posix_memalign(&ptr, alignof(TraceEventRing), size)) {
+      llvm::report_bad_alloc_error("Failed to allocate a trace event ring");
+    }
+    return ptr;
+  }
+  static void operator delete(void *ptr) { free(ptr); }
+
+  /// Moves \p event into the ring. Producer side only. \returns false if the
+  /// ring is full, leaving \p event untouched.
+  bool tryPush(TraceEvent &event) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) {
+      return false;
+    }
+    slots_[tail & mask_].emplace(std::move(event));
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Moves all queued events to the back of \p out. Consumer side only.
+  /// \returns the number of events moved.
+  size_t drain(std::vector<TraceEvent> &out) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    for (size_t i = head; i != tail; i++) {
+      llvm::Optional<TraceEvent> &slot = slots_[i & mask_];
+      out.push_back(std::move(*slot));
+      slot.reset();
+    }
+    head_.store(tail, std::memory_order_release);
+    return tail - head;
+  }
+
+private:
+  std::vector<llvm::Optional<TraceEvent>> slots_;
+  size_t mask_;
+  /// The indices live on separate cache lines so the producer and consumer
+  /// do not false-share.
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+};
+
+/// Collects trace events from a fixed number of producer threads through one
+/// TraceEventRing each. A background writer drains all rings and hands the
+/// drained events to a sink, so producers never contend with each other or
+/// with whoever consumes the events.
+class TraceCollector {
+public:
+  /// Receives every drained batch of events on the writer thread.
+  using Sink = std::function<void(std::vector<TraceEvent> &events)>;
+
+  TraceCollector(size_t numProducers, size_t ringCapacity, Sink sink)
+      : sink_(std::move(sink)) {
+    for (size_t i = 0; i < numProducers; i++) {
+      rings_.push_back(std::unique_ptr<TraceEventRing>(
+          new TraceEventRing(ringCapacity)));
+    }
+    writer_ = std::thread([this]() { writerLoop(); });
+  }
+
+  ~TraceCollector() { finish(); }
+
+  /// Moves all events of \p context into the ring of \p producer and clears
+  /// them from \p context. Waits for the writer if the ring is full.
+  void publish(size_t producer, TraceContext &context) {
+    TraceEventRing &ring = *rings_[producer];
+    for (auto &event : context.getTraceEvents()) {
+      if (!ring.tryPush(event)) {
+        stalls_.fetch_add(1, std::memory_order_relaxed);
+        do {
+          std::this_thread::yield();
+        } while (!ring.tryPush(event));
+      }
+    }
+    context.getTraceEvents().clear();
+  }
+
+  /// Stops the writer after it drained every ring. Idempotent.
+  void finish() {
+    if (writer_.joinable()) {
+      stop_.store(true, std::memory_order_release);
+      writer_.join();
+    }
+  }
+
+  /// \returns the number of events passed to the sink so far.
+  size_t numEvents() const { return events_.load(); }
+
+  /// \returns how often a producer found its ring full.
+  size_t numStalls() const { return stalls_.load(); }
+
+private:
+  void writerLoop() {
+    std::vector<TraceEvent> batch;
+    while (true) {
+      // Read the flag before draining so the last drain sees every event
+      // published before finish() was called.
+      const bool stopping = stop_.load(std::memory_order_acquire);
+      for (auto &ring : rings_) {
+        ring->drain(batch);
+      }
+      if (!batch.empty()) {
+        events_ += batch.size();
+        sink_(batch);
+        batch.clear();
+      } else if (stopping) {
+        return;
+      } else {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  }
+
+  Sink sink_;
+  std::vector<std::unique_ptr<TraceEventRing>> rings_;
+  std::thread writer_;
+  std::atomic<bool> stop_{false};
+  std::atomic<size_t> events_{0};
+  std::atomic<size_t> stalls_{0};
+};
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_TRACEEVENTRING_H
@@ -0,0 +1,171 @@
+/**
+ * Copyright (c) Glow Contributors. See CONTRIBUTORS file.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef GLOW_TOOLS_LOADER_TRACEWRITER_H
+#define GLOW_TOOLS_LOADER_TRACEWRITER_H
+
+#include "glow/ExecutionContext/TraceEvents.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <unistd.h>
+
+namespace glow {
+
+/// Writes trace events incrementally as a Chrome trace JSON array, in the
+/// same format as TraceContext::dump(). Formatted events are buffered and the
+/// buffer is written out whenever it exceeds a byte budget, so memory use is
+/// bounded no matter how long the traced run is. Every event is written as a
+/// separate ",\n{...}" record, so a file cut short by a crash is repaired by
+/// appending "]".
+class TraceWriter {
+public:
+  /// Opens \p path and writes the array header naming the process
+  /// \p processName. Formatted events are flushed once more than
+  /// \p maxBufferedBytes are buffered.
+  TraceWriter(llvm::StringRef path, llvm::StringRef processName,
+              size_t maxBufferedBytes)
+      : maxBufferedBytes_(maxBufferedBytes), pid_(getpid()),
+        buffer_(bufferStorage_) {
+    file_.reset(new llvm::raw_fd_ostream(path, EC_));
+    if (EC_) {
+      llvm::errs() << "Failed to open trace file " << path << ": "
+                   << EC_.message() << "\n";
+      file_.reset();
+      return;
+    }
+    *file_ << "[\n";
+    writeMetadata("process_name", 0, processName);
+  }
+
+  ~TraceWriter() { finish({}); }
+
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter &operator=(const TraceWriter &) = delete;
+
+  /// \returns whether the trace file could be opened.
+  bool isOpen() const { return file_ != nullptr; }
+
+  /// Formats \p events into the buffer, flushing it to the file when it grows
+  /// beyond the byte budget.
+  void append(llvm::ArrayRef<TraceEvent> events) {
+    if (!file_) {
+      return;
+    }
+    for (const auto &event : events) {
+      buffer_ << ",\n{\"name\": \"";
+      writeEscaped(buffer_, event.name);
+      buffer_ << "\", \"cat\": \"glow\", \"ph\": \"" << event.type
+              << "\", \"ts\": " << event.timestamp << ", \"pid\": " << pid_
+              << ", \"tid\": " << event.tid;
+      if (event.type == TraceEvent::CompleteType) {
+        buffer_ << ", \"dur\": " << event.duration;
+      }
+      if (!event.args.empty()) {
+        buffer_ << ", \"args\": {";
+        bool first = true;
+        for (const auto &arg : event.args) {
+          buffer_ << (first ? "\"" : ", \"");
+          writeEscaped(buffer_, arg.first);
+          buffer_ << "\": \"";
+          writeEscaped(buffer_, arg.second);
+          buffer_ << "\"";
+          first = false;
+        }
+        buffer_ << "}";
+      }
+      buffer_ << "}";
+      numEvents_++;
+      if (bufferStorage_.size() >= maxBufferedBytes_) {
+        flush();
+      }
+    }
+  }
+
+  /// Writes the buffered events, the names in \p threadNames and the end of
+  /// the array, and closes the file. Idempotent.
+  void finish(const std::map<int, std::string> &threadNames) {
+    if (!file_) {
+      return;
+    }
+    for (const auto &name : threadNames) {
+      writeMetadata("thread_name", name.first, name.second);
+    }
+    flush();
+    *file_ << "\n]\n";
+    file_.reset();
+  }
+
+  /// \returns the number of events written so far.
+  size_t numEvents() const { return numEvents_; }
+
+  /// \returns the number of times the buffer was written to the file.
+  size_t numFlushes() const { return numFlushes_; }
+
+  /// Writes \p str to \p os as the contents of a JSON string: quotes and
+  /// backslashes are escaped and control characters become spaces.
+  static void writeEscaped(llvm::raw_ostream &os, llvm::StringRef str) {
+    for (char c : str) {
+      if (c == '"' || c == '\\') {
+        os << '\\' << c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        os << ' ';
+      } else {
+        os << c;
+      }
+    }
+  }
+
+private:
+  void writeMetadata(llvm::StringRef kind, int tid, llvm::StringRef name) {
+    buffer_ << (kind == "process_name" ? "" : ",\n") << "{\"name\": \"" << kind
+            << "\", \"ph\": \"M\", \"ts\": 0, \"pid\": " << pid_
+            << ", \"tid\": " << tid << ", \"args\": {\"name\": \"";
+    writeEscaped(buffer_, name);
+    buffer_ << "\"}}";
+  }
+
+  void flush() {
+    buffer_.flush();
+    if (bufferStorage_.empty()) {
+      return;
+    }
+    *file_ << bufferStorage_;
+    file_->flush();
+    bufferStorage_.clear();
+    numFlushes_++;
+  }
+
+  size_t maxBufferedBytes_;
+  int pid_;
+  std::error_code EC_;
+  std::unique_ptr<llvm::raw_fd_ostream> file_;
+  std::string bufferStorage_;
+  llvm::raw_string_ostream buffer_;
+  size_t numEvents_{0};
+  size_t numFlushes_{0};
+};
+
+} // namespace glow
+
+#endif // GLOW_TOOLS_LOADER_TRACEWRITER_H
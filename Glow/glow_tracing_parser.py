@@ -76,11 +76,24 @@ class Event:
         return (self.end - self.start) - self.child_time
 
 
+def loadTrace(filename):
+    """ Load the json trace array. The executor streams the trace to disk
+        while running, so a run that was killed leaves the array unterminated;
+        such a trace is loaded up to its last complete event. """
+    with open(filename) as f:
+        text = f.read()
+    for candidate in (text, text + "\n]"):
+        try:
+            return json.loads(candidate)
+        except json.JSONDecodeError:
+            pass
+    # Every record after the first starts on its own ",\n{" line.
+    return json.loads(text[:text.rfind(",\n{")] + "\n]")
+
+
 def loadEvents(filename, runtimeEvents, fixedEvent, skip):
     """ Load the json trace file and create Events. """
-    trace = None
-    with open(filename) as f:
-        trace = json.load(f)
+    trace = loadTrace(filename)
     events = []
     partialEvents = {}
     for line in trace:
@@ -295,6 +308,12 @@ def main():
                         help="print a summary of the trace")
     parser.add_argument('--resnet50', action='store_true',
                         help='display by resnet50 layers')
+    parser.add_argument("--runtime", action='store_true',
+                        help="include runtime events")
+    parser.add_argument("--event", type=str,
+                        help="only load events whose name or kind matches")
+    parser.add_argument("--skip", type=int, default=0,
+                        help="skip the first N loaded events")
 
     args = parser.parse_args()
     events = loadEvents(args.filename, args.runtime, args.event, args.skip)
@@ -0,0 +1,2 @@
+log_path=../logs/glow-$1-2080Ti
+./bin/image-classifier ./images/*.png -image-mode=0to1 -model-list=../utils/list -model-list-prefix=./models/ -model-list-suffix=.onnx -model-input-name=data -backend=$1 -int8-compare -int8-compare-results=$log_path/int8_compare.csv | tee -a $log_path/int8_compare.log
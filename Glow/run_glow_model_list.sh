@@ -0,0 +1,2 @@
+log_path=../logs/glow-$1-2080Ti
+./bin/image-classifier ./images/cat_285.png -image-mode=0to1 -model-list=../utils/list -model-list-prefix=./models/ -model-list-suffix=.onnx -model-input-name=data -backend=$1 -model-list-results=$log_path/model_list.csv | tee -a $log_path/model_list.log
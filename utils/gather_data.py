@@ -26,10 +26,12 @@ FINISH
 
 def get_time(fileName=""):
 
-  # 当跑15轮，抛弃前5轮做warmup时
-  # 共有10个iteration time， 1个average time
-  # 存到len=11的data list中
+  # 默认跑15轮，抛弃前5轮做warmup时，共有10个iteration time，1个average time；
+  # 使用-latency-adaptive时iteration time的个数不固定
+  # 存到data list中，最后一个是average time
   data = []
+  num_avg = 0
+  last_is_avg = False
   file = open(fileName) 
   for line in file:
     s='time(s) is '
@@ -38,10 +40,14 @@ def get_time(fileName=""):
     if fd != -1:
         time = float(line[first:])
         data.append(time)
+        # 最后一个time(s)行必须是average time
+        last_is_avg = line.find('average') != -1
+        if last_is_avg:
+            num_avg += 1
   file.close()    
 
   try:
-    assert(len(data)==11)
+    assert(num_avg==1 and last_is_avg and len(data)>=2)
   except:
     data = [-1 for i in range(0,11)]
 
@@ -75,11 +81,17 @@ if __name__ == "__main__":
     f.close()
     print(s)
 
-    data = pd.DataFrame.from_dict(data=s, orient='index')
-
-    label = ['it'+str(i) for i in range(0,10)]
+    # 每个模型的iteration个数可能不同，按列名对齐，缺少的iteration为空
+    n = max([len(v) for v in s.values()] + [11]) - 1
+    label = ['it'+str(i) for i in range(0,n)]
     label.append('avg')
-    data.columns=label
+    rows = {}
+    for key in s:
+        times = s[key]
+        row = {'it'+str(i): times[i] for i in range(0,len(times)-1)}
+        row['avg'] = times[-1]
+        rows.update({key:row})
+    data = pd.DataFrame.from_dict(data=rows, orient='index', columns=label)
 
 
     data.to_csv('csv/' + csv  +'.csv')